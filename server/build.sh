@@ -10,7 +10,7 @@ fi
 cd cpp_algorithms
 g++ -std=c++17 trending.cpp -o trending -I../include
 g++ -std=c++17 user_recommend.cpp -o user_recommend -I../include
-g++ -std=c++17 search.cpp -o search -I../include
+g++ -std=c++17 -O2 -pthread search.cpp -o search -I../include
 g++ -std=c++17 fav_category.cpp -o fav_category -I../include
 g++ -std=c++17 brought_together.cpp -o brought_together -I../include
 
@@ -4,11 +4,39 @@
 #include <unordered_set>
 #include <vector>
 #include <set>
+#include <map>
 #include <string>
 #include "../include/nlohmann/json.hpp"
 #include <algorithm>
 #include <curl/curl.h>
 #include <sstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <array>
+#include <functional>
+#include <chrono>
+#include <tuple>
+#include <string_view>
+#include <cerrno>
+#include <cstdio>
+#include <initializer_list>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 using json = nlohmann::json;
@@ -35,312 +63,5969 @@ struct Product {
           image(img), description(d), brand(b), discountPercentage(dp) {}
 };
 
-// Enhanced Trie Node Structure
+// Product fields scored separately by BM25F
+enum SearchField { FIELD_NAME, FIELD_BRAND, FIELD_CATEGORY, FIELD_DESCRIPTION, FIELD_COUNT };
+
+// One product's occurrences of a term, counted per field, and how many
+// positions it appended to the term's position list (build time only)
+struct TermOccurrence {
+    uint32_t doc;
+    array<uint16_t, FIELD_COUNT> tf;
+    uint32_t positionCount;
+};
+
+// Word positions are stored as field << POSITION_FIELD_SHIFT | word index
+// within the field, so positions sort by field and adjacent words of a field
+// differ by one
+static constexpr uint32_t POSITION_FIELD_SHIFT = 16;
+static constexpr uint32_t MAX_FIELD_POSITION = (1u << POSITION_FIELD_SHIFT) - 1;
+
+// Substring search kernels over pre-lowercased text. Each returns the first
+// occurrence of needle in [begin, end), or end. The SIMD versions compare the
+// needle's first and last bytes against a whole vector of candidate positions
+// and only memcmp the middle where both agree.
+static const char* findSubstringScalar(const char* begin, const char* end,
+                                       const char* needle, size_t length) {
+    string_view haystack(begin, end - begin);
+    size_t position = haystack.find(string_view(needle, length));
+    return position == string_view::npos ? end : begin + position;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static const char* findSubstringAvx2(const char* begin, const char* end,
+                                     const char* needle, size_t length) {
+    if (length < 2) return findSubstringScalar(begin, end, needle, length);
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+    size_t size = end - begin;
+    size_t i = 0;
+    for (; i + length - 1 + 32 <= size; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + i));
+        __m256i blockLast = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + i + length - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast))));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(begin + i + bit + 1, needle + 1, length - 2) == 0) return begin + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringScalar(begin + i, end, needle, length);
+}
+
+static const char* findSubstringSse2(const char* begin, const char* end,
+                                     const char* needle, size_t length) {
+    if (length < 2) return findSubstringScalar(begin, end, needle, length);
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    size_t size = end - begin;
+    size_t i = 0;
+    for (; i + length - 1 + 16 <= size; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + i));
+        __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + i + length - 1));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(last, blockLast))));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(begin + i + bit + 1, needle + 1, length - 2) == 0) return begin + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringScalar(begin + i, end, needle, length);
+}
+#endif
+
+using SubstringFinder = const char* (*)(const char*, const char*, const char*, size_t);
+
+// Pick the widest kernel this CPU supports (SSE2 is baseline on x86-64)
+static SubstringFinder selectSubstringFinder() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findSubstringAvx2;
+    if (__builtin_cpu_supports("sse2")) return findSubstringSse2;
+#endif
+    return findSubstringScalar;
+}
+
+static const SubstringFinder findSubstring = selectSubstringFinder();
+
+// Bit-parallel Levenshtein distance (Myers 1999, in Hyyro's global form).
+// The pattern's per-character match masks are built once, so one matcher is
+// reused against every target; patterns longer than 64 characters are split
+// into 64-bit blocks that pass their horizontal delta down the column.
+class MyersMatcher {
+public:
+    explicit MyersMatcher(const string& pattern)
+        : length(pattern.size()), blocks((pattern.size() + 63) / 64),
+          peq(blocks * 256, 0) {
+        for (size_t i = 0; i < length; i++) {
+            peq[(i / 64) * 256 + static_cast<unsigned char>(pattern[i])] |= uint64_t(1) << (i % 64);
+        }
+    }
+
+    // Edit distance between the pattern and text. Once the distance is certain
+    // to exceed maxDistance, returns maxDistance + 1 without finishing.
+    int distance(string_view text, int maxDistance = INT_MAX) const {
+        int n = static_cast<int>(text.size());
+        int m = static_cast<int>(length);
+        if (abs(n - m) > maxDistance) return maxDistance + 1;
+        if (m == 0) return n;
+        return blocks == 1 ? distanceSingle(text, maxDistance) : distanceBlocked(text, maxDistance);
+    }
+
+private:
+    size_t length;
+    size_t blocks;
+    vector<uint64_t> peq;  // blocks x 256 match masks
+
+    int distanceSingle(string_view text, int maxDistance) const {
+        uint64_t lastBit = uint64_t(1) << (length - 1);
+        uint64_t pv = ~uint64_t(0);
+        uint64_t mv = 0;
+        int score = static_cast<int>(length);
+        int remaining = static_cast<int>(text.size());
+
+        for (char c : text) {
+            uint64_t eq = peq[static_cast<unsigned char>(c)];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & lastBit) score++;
+            else if (mh & lastBit) score--;
+            ph = (ph << 1) | 1;  // top row of the global matrix grows by one per column
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+
+            // The score falls by at most one per remaining column
+            if (score - --remaining > maxDistance) return maxDistance + 1;
+        }
+        return score;
+    }
+
+    int distanceBlocked(string_view text, int maxDistance) const {
+        vector<uint64_t> pv(blocks, ~uint64_t(0));
+        vector<uint64_t> mv(blocks, 0);
+        uint64_t lastBit = uint64_t(1) << ((length - 1) % 64);
+        const uint64_t highBit = uint64_t(1) << 63;
+        int score = static_cast<int>(length);
+        int remaining = static_cast<int>(text.size());
+
+        for (char c : text) {
+            int hin = 1;
+            for (size_t b = 0; b < blocks; b++) {
+                uint64_t eq = peq[b * 256 + static_cast<unsigned char>(c)];
+                uint64_t hinNegative = hin < 0 ? 1 : 0;
+                uint64_t xv = eq | mv[b];
+                eq |= hinNegative;
+                uint64_t xh = (((eq & pv[b]) + pv[b]) ^ pv[b]) | eq;
+                uint64_t ph = mv[b] | ~(xh | pv[b]);
+                uint64_t mh = pv[b] & xh;
+
+                uint64_t outBit = b + 1 == blocks ? lastBit : highBit;
+                int hout = (ph & outBit) ? 1 : (mh & outBit) ? -1 : 0;
+
+                ph = (ph << 1) | (hin > 0 ? 1 : 0);
+                mh = (mh << 1) | hinNegative;
+                pv[b] = mh | ~(xv | ph);
+                mv[b] = ph & xv;
+                hin = hout;
+            }
+            score += hin;
+
+            if (score - --remaining > maxDistance) return maxDistance + 1;
+        }
+        return score;
+    }
+};
+
+// Levenshtein automaton for one query, simulated bit-parallel (Wu-Manber):
+// bit j of state[e] means the first j query characters match the text read
+// so far with at most e edits. Queries up to 63 characters fit one word.
+class LevenshteinAutomaton {
+public:
+    static constexpr int MAX_EDITS = 2;
+    static constexpr size_t MAX_QUERY_LENGTH = 63;
+    using State = array<uint64_t, MAX_EDITS + 1>;
+
+    LevenshteinAutomaton(const string& query, int maxEdits)
+        : length(query.size()), maxEdits(min(maxEdits, MAX_EDITS)),
+          fullMask(length >= 63 ? ~uint64_t(0) : (uint64_t(1) << (length + 1)) - 1),
+          acceptBit(uint64_t(1) << min<size_t>(length, 63)) {
+        charMasks.fill(0);
+        for (size_t j = 0; j < length && j < MAX_QUERY_LENGTH; j++) {
+            charMasks[static_cast<unsigned char>(query[j])] |= uint64_t(1) << (j + 1);
+        }
+    }
+
+    State start() const {
+        State state{};
+        for (int e = 0; e <= maxEdits; e++) {
+            state[e] = ((uint64_t(1) << (e + 1)) - 1) & fullMask;  // delete up to e query chars
+        }
+        return state;
+    }
+
+    State step(const State& state, char c) const {
+        uint64_t matches = charMasks[static_cast<unsigned char>(c)];
+        State next{};
+        next[0] = (state[0] << 1) & matches;
+        for (int e = 1; e <= maxEdits; e++) {
+            next[e] = ((state[e] << 1) & matches)   // match
+                    | state[e - 1]                  // insertion into the query
+                    | (state[e - 1] << 1)           // substitution
+                    | (next[e - 1] << 1)            // deletion from the query
+                    | next[e - 1];
+            next[e] &= fullMask;
+        }
+        return next;
+    }
+
+    bool isDead(const State& state) const { return state[maxEdits] == 0; }
+
+    // Fewest edits with which the whole query matches the text read, or -1
+    int acceptedEdits(const State& state) const {
+        for (int e = 0; e <= maxEdits; e++) {
+            if (state[e] & acceptBit) return e;
+        }
+        return -1;
+    }
+
+    // Whether reading more text could still match the whole query with
+    // fewer than acceptedEdits edits
+    bool canImprove(const State& state, int acceptedEdits) const {
+        return acceptedEdits > 0 && state[acceptedEdits - 1] != 0;
+    }
+
+private:
+    size_t length;
+    int maxEdits;
+    uint64_t fullMask;
+    uint64_t acceptBit;
+    array<uint64_t, 256> charMasks;
+};
+
+// Reusable dense score table indexed by doc. Each doc's slot is stamped with
+// the current query's epoch on first touch, so starting a new query costs
+// O(1) and reading the results costs the touched count, not the catalog size.
+class ScoreAccumulator {
+public:
+    void reset(size_t docCount) {
+        if (scores.size() < docCount) {
+            scores.resize(docCount);
+            stamps.resize(docCount, 0);
+        }
+        touched.clear();
+        if (++epoch == 0) {  // wrapped: clear stale stamps once
+            fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    void add(uint32_t doc, double score) { slot(doc) += score; }
+
+    void raise(uint32_t doc, double score) {
+        double& current = slot(doc);
+        current = max(current, score);
+    }
+
+    const vector<uint32_t>& touchedDocs() const { return touched; }
+
+    // Touched docs in doc order: sorted when few, read off the stamps in one
+    // linear pass when they are a large share of the table
+    void touchedInDocOrder(vector<uint32_t>& out) const {
+        out.clear();
+        if (touched.size() * 64 < stamps.size()) {
+            out = touched;
+            sort(out.begin(), out.end());
+            return;
+        }
+        for (uint32_t doc = 0; doc < stamps.size(); doc++) {
+            if (stamps[doc] == epoch) out.push_back(doc);
+        }
+    }
+    double score(uint32_t doc) const { return scores[doc]; }
+
+private:
+    vector<double> scores;
+    vector<uint32_t> stamps;
+    vector<uint32_t> touched;
+    uint32_t epoch = 0;
+
+    double& slot(uint32_t doc) {
+        if (stamps[doc] != epoch) {
+            stamps[doc] = epoch;
+            scores[doc] = 0.0;
+            touched.push_back(doc);
+        }
+        return scores[doc];
+    }
+};
+
+// Per-thread scratch reused across queries; daemon connections each get one
+struct SearchScratch {
+    ScoreAccumulator relevance;
+    ScoreAccumulator fuzzy;
+    vector<pair<double, int>> ranked;
+};
+
+// How advancedSearch evaluates its scored lists: every posting term-at-a-time,
+// or document-at-a-time with WAND or block-max WAND pruning. All three return
+// the same results; the pruned modes just score fewer postings.
+enum class EvaluationMode { Exhaustive, Wand, BlockMaxWand };
+
+// How a typo-tolerant trie walk ended: it covered every match, stopped at
+// its visit cap, or ran out of time
+enum class FuzzyWalk { COMPLETE, CAPPED, TIMED_OUT };
+
+EvaluationMode parseEvaluationMode(const string& name) {
+    if (name == "exhaustive") return EvaluationMode::Exhaustive;
+    if (name == "wand") return EvaluationMode::Wand;
+    if (name == "bmw") return EvaluationMode::BlockMaxWand;
+    throw invalid_argument("Unknown search mode: " + name);
+}
+
+string evaluationModeName(EvaluationMode mode) {
+    switch (mode) {
+        case EvaluationMode::Exhaustive: return "exhaustive";
+        case EvaluationMode::Wand: return "wand";
+        default: return "bmw";
+    }
+}
+
+// Array of frozen index data. While an index is built it owns a vector and
+// offers the vector operations the build uses; an index mapped from a file
+// points it at the file's bytes instead, which are read-only and never
+// copied. Mutating a mapped array is a bug.
+template <typename T>
+class IndexArray {
+public:
+    IndexArray() = default;
+    IndexArray(initializer_list<T> items) : owned(items) { sync(); }
+    IndexArray(const IndexArray&) = delete;
+    IndexArray& operator=(const IndexArray&) = delete;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t capacity() const { return isMapped ? count : owned.capacity(); }
+
+    const T* data() const { return items; }
+    T* data() { return const_cast<T*>(items); }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+    T* begin() { return data(); }
+    T* end() { return data() + count; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T& operator[](size_t i) { return data()[i]; }
+
+    void push_back(const T& item) {
+        owned.push_back(item);
+        sync();
+    }
+
+    template <typename Iterator>
+    void insert(const T* position, Iterator first, Iterator last) {
+        owned.insert(owned.begin() + (position - owned.data()), first, last);
+        sync();
+    }
+
+    void erase(const T* first, const T* last) {
+        owned.erase(owned.begin() + (first - owned.data()), owned.begin() + (last - owned.data()));
+        sync();
+    }
+
+    void assign(size_t n, const T& value) {
+        owned.assign(n, value);
+        sync();
+    }
+
+    void clear() {
+        owned.clear();
+        sync();
+    }
+
+    void shrink_to_fit() {
+        owned.shrink_to_fit();
+        sync();
+    }
+
+    // Serve count items read in place from mapped memory
+    void map(const T* mappedItems, size_t mappedCount) {
+        vector<T>().swap(owned);
+        items = mappedItems;
+        count = mappedCount;
+        isMapped = true;
+    }
+
+private:
+    vector<T> owned;
+    const T* items = nullptr;
+    size_t count = 0;
+    bool isMapped = false;
+
+    void sync() {
+        items = owned.data();
+        count = owned.size();
+        isMapped = false;
+    }
+};
+
+// Roaring-style compressed doc set. Docs are grouped by their high 16 bits
+// into containers; a container holds a sorted array of low halves while it
+// is sparse and switches to a 65536-bit bitmap past ARRAY_LIMIT entries.
+// Set operations work container by container on whichever forms meet.
+class RoaringBitmap {
+public:
+    // A container as a frozen index stores it: the array or bitmap sits at
+    // offset in a pool of low halves or of bitmap words shared by every set
+    struct StoredContainer {
+        uint16_t key;
+        uint16_t isBitmap;
+        uint32_t cardinality;
+        uint64_t offset;
+    };
+
+    // Append a doc larger than every doc already in the set
+    void add(uint32_t doc) {
+        uint16_t key = static_cast<uint16_t>(doc >> 16);
+        uint16_t low = static_cast<uint16_t>(doc & 0xFFFF);
+        if (containers.empty() || containers.back().key != key) {
+            containers.emplace_back(key);
+        }
+        Container& container = containers.back();
+        if (container.isBitmap()) {
+            container.bits[low >> 6] |= 1ULL << (low & 63);
+        } else {
+            container.values.push_back(low);
+            if (container.values.size() > ARRAY_LIMIT) container.toBitmap();
+        }
+        container.cardinality++;
+    }
+
+    static RoaringBitmap fromSorted(const uint32_t* docs, size_t count) {
+        RoaringBitmap set;
+        for (size_t i = 0; i < count; i++) set.add(docs[i]);
+        return set;
+    }
+
+    // Append the set's containers to the stored pools
+    void store(IndexArray<StoredContainer>& stored, IndexArray<uint16_t>& lows,
+               IndexArray<uint64_t>& words) const {
+        for (const Container& container : containers) {
+            StoredContainer entry{container.key, container.isBitmap(), container.cardinality,
+                                  container.isBitmap() ? words.size() : lows.size()};
+            if (container.isBitmap()) {
+                words.insert(words.end(), container.words(), container.words() + BITMAP_WORDS);
+            } else {
+                lows.insert(lows.end(), container.lows(), container.lows() + container.cardinality);
+            }
+            stored.push_back(entry);
+        }
+    }
+
+    // A set over stored containers, reading the pools in place; they must
+    // outlive it and every set derived from it
+    static RoaringBitmap view(const StoredContainer* begin, const StoredContainer* end,
+                              const uint16_t* lows, const uint64_t* words) {
+        RoaringBitmap set;
+        set.containers.reserve(end - begin);
+        for (const StoredContainer* entry = begin; entry != end; entry++) {
+            Container container{entry->key, entry->cardinality};
+            if (entry->isBitmap) {
+                container.storedBits = words + entry->offset;
+            } else {
+                container.storedValues = lows + entry->offset;
+            }
+            set.containers.push_back(move(container));
+        }
+        return set;
+    }
+
+    bool contains(uint32_t doc) const {
+        const Container* container = find(static_cast<uint16_t>(doc >> 16));
+        return container && container->test(static_cast<uint16_t>(doc & 0xFFFF));
+    }
+
+    size_t cardinality() const {
+        size_t total = 0;
+        for (const Container& container : containers) total += container.cardinality;
+        return total;
+    }
+
+    bool empty() const { return containers.empty(); }
+
+    // Visit every doc in increasing order
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (const Container& container : containers) {
+            uint32_t high = uint32_t(container.key) << 16;
+            if (!container.isBitmap()) {
+                for (const uint16_t* low = container.lows(); low != container.lowsEnd(); low++) visit(high | *low);
+                continue;
+            }
+            const uint64_t* words = container.words();
+            for (uint32_t word = 0; word < BITMAP_WORDS; word++) {
+                for (uint64_t bits = words[word]; bits; bits &= bits - 1) {
+                    visit(high | (word << 6) | uint32_t(__builtin_ctzll(bits)));
+                }
+            }
+        }
+    }
+
+    vector<uint32_t> toVector() const {
+        vector<uint32_t> docs;
+        docs.reserve(cardinality());
+        forEach([&docs](uint32_t doc) { docs.push_back(doc); });
+        return docs;
+    }
+
+    static RoaringBitmap intersect(const RoaringBitmap& a, const RoaringBitmap& b) {
+        RoaringBitmap result;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() && j < b.containers.size()) {
+            const Container& x = a.containers[i];
+            const Container& y = b.containers[j];
+            if (x.key < y.key) { i++; continue; }
+            if (y.key < x.key) { j++; continue; }
+            Container both = intersectContainers(x, y);
+            if (both.cardinality) result.containers.push_back(move(both));
+            i++;
+            j++;
+        }
+        return result;
+    }
+
+    static RoaringBitmap unite(const RoaringBitmap& a, const RoaringBitmap& b) {
+        RoaringBitmap result;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() || j < b.containers.size()) {
+            if (j == b.containers.size() || (i < a.containers.size() && a.containers[i].key < b.containers[j].key)) {
+                result.containers.push_back(a.containers[i++]);
+            } else if (i == a.containers.size() || b.containers[j].key < a.containers[i].key) {
+                result.containers.push_back(b.containers[j++]);
+            } else {
+                result.containers.push_back(uniteContainers(a.containers[i++], b.containers[j++]));
+            }
+        }
+        return result;
+    }
+
+    // a ANDNOT b
+    static RoaringBitmap subtract(const RoaringBitmap& a, const RoaringBitmap& b) {
+        RoaringBitmap result;
+        size_t j = 0;
+        for (const Container& x : a.containers) {
+            while (j < b.containers.size() && b.containers[j].key < x.key) j++;
+            if (j == b.containers.size() || b.containers[j].key != x.key) {
+                result.containers.push_back(x);
+                continue;
+            }
+            Container rest = subtractContainers(x, b.containers[j]);
+            if (rest.cardinality) result.containers.push_back(move(rest));
+        }
+        return result;
+    }
+
+    // |a AND b| without materializing the intersection
+    static size_t intersectCount(const RoaringBitmap& a, const RoaringBitmap& b) {
+        size_t count = 0;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() && j < b.containers.size()) {
+            const Container& x = a.containers[i];
+            const Container& y = b.containers[j];
+            if (x.key < y.key) { i++; continue; }
+            if (y.key < x.key) { j++; continue; }
+            count += intersectContainerCount(x, y);
+            i++;
+            j++;
+        }
+        return count;
+    }
+
+    // Stored containers count only their headers; their data is in the pools
+    size_t memoryBytes() const {
+        size_t bytes = containers.capacity() * sizeof(Container);
+        for (const Container& container : containers) {
+            bytes += container.values.capacity() * sizeof(uint16_t) + container.bits.capacity() * sizeof(uint64_t);
+        }
+        return bytes;
+    }
+
+private:
+    static constexpr size_t ARRAY_LIMIT = 4096;
+    static constexpr uint32_t BITMAP_WORDS = 1024;
+
+    struct Container {
+        uint16_t key = 0;
+        uint32_t cardinality = 0;
+        vector<uint16_t> values;  // sorted low halves, while sparse
+        vector<uint64_t> bits;    // BITMAP_WORDS words, once dense
+        const uint16_t* storedValues = nullptr;  // instead of values/bits, for
+        const uint64_t* storedBits = nullptr;    // containers read in place
+
+        explicit Container(uint16_t key, uint32_t cardinality = 0) : key(key), cardinality(cardinality) {}
+
+        bool isBitmap() const { return storedBits || !bits.empty(); }
+        const uint16_t* lows() const { return storedValues ? storedValues : values.data(); }
+        const uint16_t* lowsEnd() const { return lows() + cardinality; }
+        const uint64_t* words() const { return storedBits ? storedBits : bits.data(); }
+
+        void toBitmap() {
+            bits.assign(BITMAP_WORDS, 0);
+            for (uint16_t low : values) bits[low >> 6] |= 1ULL << (low & 63);
+            vector<uint16_t>().swap(values);
+        }
+
+        // Recount a bitmap and fall back to an array when it got sparse
+        void normalize() {
+            cardinality = 0;
+            for (uint64_t word : bits) cardinality += __builtin_popcountll(word);
+            if (cardinality > ARRAY_LIMIT) return;
+            values.clear();
+            for (uint32_t word = 0; word < BITMAP_WORDS; word++) {
+                for (uint64_t w = bits[word]; w; w &= w - 1) {
+                    values.push_back(static_cast<uint16_t>((word << 6) | __builtin_ctzll(w)));
+                }
+            }
+            vector<uint64_t>().swap(bits);
+        }
+
+        bool test(uint16_t low) const {
+            if (isBitmap()) return words()[low >> 6] >> (low & 63) & 1;
+            return binary_search(lows(), lowsEnd(), low);
+        }
+    };
+
+    vector<Container> containers;  // sorted by key
+
+    const Container* find(uint16_t key) const {
+        auto it = lower_bound(containers.begin(), containers.end(), key,
+                              [](const Container& c, uint16_t k) { return c.key < k; });
+        return it != containers.end() && it->key == key ? &*it : nullptr;
+    }
+
+    static Container intersectContainers(const Container& x, const Container& y) {
+        Container result{x.key};
+        if (x.isBitmap() && y.isBitmap()) {
+            result.bits.resize(BITMAP_WORDS);
+            const uint64_t* xWords = x.words();
+            const uint64_t* yWords = y.words();
+            for (uint32_t w = 0; w < BITMAP_WORDS; w++) result.bits[w] = xWords[w] & yWords[w];
+            result.normalize();
+            return result;
+        }
+        if (!x.isBitmap() && !y.isBitmap()) {
+            set_intersection(x.lows(), x.lowsEnd(), y.lows(), y.lowsEnd(), back_inserter(result.values));
+        } else {
+            const Container& sparse = x.isBitmap() ? y : x;
+            const Container& dense = x.isBitmap() ? x : y;
+            for (const uint16_t* low = sparse.lows(); low != sparse.lowsEnd(); low++) {
+                if (dense.test(*low)) result.values.push_back(*low);
+            }
+        }
+        result.cardinality = static_cast<uint32_t>(result.values.size());
+        return result;
+    }
+
+    static Container uniteContainers(const Container& x, const Container& y) {
+        Container result{x.key};
+        if (!x.isBitmap() && !y.isBitmap()) {
+            set_union(x.lows(), x.lowsEnd(), y.lows(), y.lowsEnd(), back_inserter(result.values));
+            result.cardinality = static_cast<uint32_t>(result.values.size());
+            if (result.values.size() > ARRAY_LIMIT) result.toBitmap();
+            return result;
+        }
+        const Container& dense = x.isBitmap() ? x : y;
+        const Container& other = x.isBitmap() ? y : x;
+        result.bits.assign(dense.words(), dense.words() + BITMAP_WORDS);
+        if (other.isBitmap()) {
+            const uint64_t* otherWords = other.words();
+            for (uint32_t w = 0; w < BITMAP_WORDS; w++) result.bits[w] |= otherWords[w];
+        } else {
+            for (const uint16_t* low = other.lows(); low != other.lowsEnd(); low++) {
+                result.bits[*low >> 6] |= 1ULL << (*low & 63);
+            }
+        }
+        result.normalize();
+        return result;
+    }
+
+    static Container subtractContainers(const Container& x, const Container& y) {
+        Container result{x.key};
+        if (x.isBitmap()) {
+            result.bits.assign(x.words(), x.words() + BITMAP_WORDS);
+            if (y.isBitmap()) {
+                const uint64_t* yWords = y.words();
+                for (uint32_t w = 0; w < BITMAP_WORDS; w++) result.bits[w] &= ~yWords[w];
+            } else {
+                for (const uint16_t* low = y.lows(); low != y.lowsEnd(); low++) {
+                    result.bits[*low >> 6] &= ~(1ULL << (*low & 63));
+                }
+            }
+            result.normalize();
+            return result;
+        }
+        for (const uint16_t* low = x.lows(); low != x.lowsEnd(); low++) {
+            if (!y.test(*low)) result.values.push_back(*low);
+        }
+        result.cardinality = static_cast<uint32_t>(result.values.size());
+        return result;
+    }
+
+    static size_t intersectContainerCount(const Container& x, const Container& y) {
+        size_t count = 0;
+        if (x.isBitmap() && y.isBitmap()) {
+            const uint64_t* xWords = x.words();
+            const uint64_t* yWords = y.words();
+            for (uint32_t w = 0; w < BITMAP_WORDS; w++) count += __builtin_popcountll(xWords[w] & yWords[w]);
+            return count;
+        }
+        if (!x.isBitmap() && !y.isBitmap()) {
+            const uint16_t* i = x.lows();
+            const uint16_t* j = y.lows();
+            while (i != x.lowsEnd() && j != y.lowsEnd()) {
+                if (*i < *j) i++;
+                else if (*j < *i) j++;
+                else { count++; i++; j++; }
+            }
+            return count;
+        }
+        const Container& sparse = x.isBitmap() ? y : x;
+        const Container& dense = x.isBitmap() ? x : y;
+        for (const uint16_t* low = sparse.lows(); low != sparse.lowsEnd(); low++) count += dense.test(*low);
+        return count;
+    }
+};
+
+// Facets the storefront sidebar filters on. Price and rating are bucketed
+// into bands; every facet value maps to a RoaringBitmap of its docs.
+enum FacetKind { FACET_BRAND, FACET_CATEGORY, FACET_PRICE, FACET_RATING, FACET_STOCK, FACET_COUNT };
+
+const char* const FACET_NAMES[FACET_COUNT] = {"brand", "category", "price", "rating", "inStock"};
+
+// Numeric interval with independently open or closed ends
+struct NumericRange {
+    double min = -HUGE_VAL;
+    double max = HUGE_VAL;
+    bool minInclusive = true;
+    bool maxInclusive = true;
+
+    bool bounded() const { return min > -HUGE_VAL || max < HUGE_VAL; }
+
+    bool contains(double value) const {
+        return (minInclusive ? value >= min : value > min) && (maxInclusive ? value <= max : value < max);
+    }
+};
+
+// Sidebar filters: values within a facet are ORed, facets are ANDed, and
+// excluded values are removed (ANDNOT). Price and rating may also be
+// constrained to an exact range.
+struct FacetFilter {
+    array<vector<string>, FACET_COUNT> include;
+    array<vector<string>, FACET_COUNT> exclude;
+    NumericRange price;
+    NumericRange rating;
+
+    bool empty() const {
+        for (int facet = 0; facet < FACET_COUNT; facet++) {
+            if (!include[facet].empty() || !exclude[facet].empty()) return false;
+        }
+        return !price.bounded() && !rating.bounded();
+    }
+};
+
+// Matching docs per facet value, for the values that have any
+using FacetCounts = array<vector<pair<string, size_t>>, FACET_COUNT>;
+
+// Node of a compiled query plan: a doc-set operator over facet bitmaps and
+// term postings. Estimates are filled in against the index and decide the
+// order an AND runs its children in.
+struct QueryPlanNode {
+    enum Kind { ALL, FACET_VALUE, RANGE, TERM, AND, OR, NOT, PHRASE };
+
+    Kind kind = ALL;
+    int facet = -1;      // facet this node constrains, -1 for none or mixed
+    string value;        // facet value label, term text, or space-separated phrase words
+    NumericRange range;
+    uint32_t slop = 0;   // PHRASE: words allowed between the phrase words, in total
+    size_t estimate = 0;
+    vector<QueryPlanNode> children;
+
+    static QueryPlanNode leaf(Kind kind, int facet, const string& value) {
+        QueryPlanNode node;
+        node.kind = kind;
+        node.facet = facet;
+        node.value = value;
+        return node;
+    }
+
+    // AND/OR/NOT over children; the node constrains a facet only when all
+    // of its children constrain the same one
+    static QueryPlanNode combine(Kind kind, vector<QueryPlanNode> children) {
+        QueryPlanNode node;
+        node.kind = kind;
+        node.facet = children.empty() ? -1 : children[0].facet;
+        for (const QueryPlanNode& child : children) {
+            if (child.facet != node.facet) node.facet = -1;
+        }
+        node.children = move(children);
+        return node;
+    }
+};
+
+static string asciiLower(string text) {
+    transform(text.begin(), text.end(), text.begin(), ::tolower);
+    return text;
+}
+
+// Porter's suffix-stripping stemmer (the reference version, with its two
+// departures from the paper: -bli -> -ble and -logi -> -log). Conflates
+// inflections such as "charges" and "charging" into one index term.
+class PorterStemmer {
+public:
+    // Stem of a lowercase word. Short words and words with anything but
+    // a-z in them (model numbers, sizes) are left as they are.
+    static string stem(const string& word) {
+        if (word.size() < 3 || !all_of(word.begin(), word.end(), [](char c) { return c >= 'a' && c <= 'z'; })) {
+            return word;
+        }
+        PorterStemmer stemmer(word);
+        stemmer.step1ab();
+        if (stemmer.k > 0) {
+            stemmer.step1c();
+            stemmer.step2();
+            stemmer.step3();
+            stemmer.step4();
+            stemmer.step5();
+        }
+        return stemmer.b.substr(0, stemmer.k + 1);
+    }
+
+private:
+    string b;  // the word; b[0..k] is the current stem
+    int k;
+    int j = 0;  // end of the stem before the suffix ends() matched
+
+    explicit PorterStemmer(const string& word) : b(word), k(static_cast<int>(word.size()) - 1) {}
+
+    bool consonant(int i) const {
+        switch (b[i]) {
+            case 'a': case 'e': case 'i': case 'o': case 'u':
+                return false;
+            case 'y':
+                return i == 0 || !consonant(i - 1);
+            default:
+                return true;
+        }
+    }
+
+    // Vowel-consonant sequences in b[0..j]: the "measure" m of the paper
+    int measure() const {
+        int n = 0;
+        int i = 0;
+        while (i <= j && consonant(i)) i++;
+        while (i <= j) {
+            while (i <= j && !consonant(i)) i++;
+            if (i > j) break;
+            n++;
+            while (i <= j && consonant(i)) i++;
+        }
+        return n;
+    }
+
+    bool vowelInStem() const {
+        for (int i = 0; i <= j; i++) {
+            if (!consonant(i)) return true;
+        }
+        return false;
+    }
+
+    bool doubleConsonant(int i) const {
+        return i >= 1 && b[i] == b[i - 1] && consonant(i);
+    }
+
+    // b[i - 2..i] is consonant-vowel-consonant and b[i] is not w, x or y
+    bool cvc(int i) const {
+        if (i < 2 || !consonant(i) || consonant(i - 1) || !consonant(i - 2)) return false;
+        return b[i] != 'w' && b[i] != 'x' && b[i] != 'y';
+    }
+
+    bool ends(const char* suffix) {
+        int length = static_cast<int>(strlen(suffix));
+        if (length > k + 1 || b.compare(k - length + 1, length, suffix) != 0) return false;
+        j = k - length;
+        return true;
+    }
+
+    // Replace b[j + 1..k] with text
+    void setTo(const char* text) {
+        b.replace(j + 1, k - j, text);
+        k = j + static_cast<int>(strlen(text));
+    }
+
+    void replaceIfMeasured(const char* text) {
+        if (measure() > 0) setTo(text);
+    }
+
+    // Plurals and -ed or -ing
+    void step1ab() {
+        if (b[k] == 's') {
+            if (ends("sses")) {
+                k -= 2;
+            } else if (ends("ies")) {
+                setTo("i");
+            } else if (b[k - 1] != 's') {
+                k--;
+            }
+        }
+        if (ends("eed")) {
+            if (measure() > 0) k--;
+        } else if ((ends("ed") || ends("ing")) && vowelInStem()) {
+            k = j;
+            if (ends("at")) {
+                setTo("ate");
+            } else if (ends("bl")) {
+                setTo("ble");
+            } else if (ends("iz")) {
+                setTo("ize");
+            } else if (doubleConsonant(k)) {
+                if (b[k] != 'l' && b[k] != 's' && b[k] != 'z') k--;
+            } else if (measure() == 1 && cvc(k)) {
+                setTo("e");
+            }
+        }
+    }
+
+    // Terminal y to i when there is another vowel in the stem
+    void step1c() {
+        if (ends("y") && vowelInStem()) b[k] = 'i';
+    }
+
+    // Double suffixes to single ones (-ization -> -ize)
+    void step2() {
+        static const pair<const char*, const char*> RULES[] = {
+            {"ational", "ate"}, {"tional", "tion"}, {"enci", "ence"}, {"anci", "ance"}, {"izer", "ize"},
+            {"bli", "ble"}, {"alli", "al"}, {"entli", "ent"}, {"eli", "e"}, {"ousli", "ous"},
+            {"ization", "ize"}, {"ation", "ate"}, {"ator", "ate"}, {"alism", "al"}, {"iveness", "ive"},
+            {"fulness", "ful"}, {"ousness", "ous"}, {"aliti", "al"}, {"iviti", "ive"}, {"biliti", "ble"},
+            {"logi", "log"}};
+        replaceFirstMatch(RULES, sizeof(RULES) / sizeof(RULES[0]));
+    }
+
+    // -ic-, -full, -ness and the like
+    void step3() {
+        static const pair<const char*, const char*> RULES[] = {
+            {"icate", "ic"}, {"ative", ""}, {"alize", "al"}, {"iciti", "ic"}, {"ical", "ic"}, {"ful", ""},
+            {"ness", ""}};
+        replaceFirstMatch(RULES, sizeof(RULES) / sizeof(RULES[0]));
+    }
+
+    // The first rule whose suffix the word ends with decides, replacing it
+    // when the stem before it has a measure above 0. The reference switches
+    // on the suffix's last letters first; no two suffixes here end one
+    // another except where the longer one comes first, so the order agrees.
+    void replaceFirstMatch(const pair<const char*, const char*>* rules, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            if (ends(rules[i].first)) {
+                replaceIfMeasured(rules[i].second);
+                return;
+            }
+        }
+    }
+
+    // -ant, -ence and the like, from stems with a measure above 1
+    void step4() {
+        static const char* const SUFFIXES[] = {"al", "ance", "ence", "er", "ic", "able", "ible", "ant", "ement",
+                                               "ment", "ent", "ion", "ou", "ism", "ate", "iti", "ous", "ive",
+                                               "ize"};
+        for (const char* suffix : SUFFIXES) {
+            if (!ends(suffix)) continue;
+            if (strcmp(suffix, "ion") == 0 && (j < 0 || (b[j] != 's' && b[j] != 't'))) return;
+            if (measure() > 1) k = j;
+            return;
+        }
+    }
+
+    // A final -e, and -ll to -l, on long enough stems
+    void step5() {
+        j = k;
+        if (b[k] == 'e') {
+            int m = measure();
+            if (m > 1 || (m == 1 && !cvc(k - 1))) k--;
+        }
+        if (b[k] == 'l' && doubleConsonant(k) && measure() > 1) k--;
+    }
+};
+
+// Words too common to search by, left out of the index and of queries
+// alike. The list is process-wide and is set before any index is built or
+// loaded (--stop-words); an index records the list it was built with and is
+// only loaded under the same one.
+class StopWords {
+public:
+    static bool contains(const string& word) {
+        return words().count(word) > 0;
+    }
+
+    // Replace the list with the words of a file, one per line; lines
+    // starting with # are comments. An empty file means no stop words.
+    static bool load(const string& path) {
+        ifstream file(path);
+        if (!file) {
+            cerr << "Could not open stop words " << path << endl;
+            return false;
+        }
+        unordered_set<string> loaded;
+        string line;
+        while (getline(file, line)) {
+            stringstream stream(line);
+            string word;
+            if (stream >> word && word[0] != '#') loaded.insert(asciiLower(word));
+        }
+        words() = move(loaded);
+        return true;
+    }
+
+    // The list in a fixed order, for the index layout
+    static string sorted() {
+        set<string> ordered(words().begin(), words().end());
+        string joined;
+        for (const string& word : ordered) joined += word + '\n';
+        return joined;
+    }
+
+private:
+    // Lucene's English default
+    static unordered_set<string>& words() {
+        static unordered_set<string> list = {
+            "a", "an", "and", "are", "as", "at", "be", "but", "by", "for", "if", "in", "into", "is", "it", "no",
+            "not", "of", "on", "or", "such", "that", "the", "their", "then", "there", "these", "they", "this",
+            "to", "was", "will", "with"};
+        return list;
+    }
+};
+
+// Lowercased words of a text as written, punctuation removed
+vector<string> surfaceWords(const string& text) {
+    vector<string> words;
+    stringstream stream(text);
+    string word;
+    while (stream >> word) {
+        word.erase(remove_if(word.begin(), word.end(), [](char c) { return !isalnum(c); }), word.end());
+        if (!word.empty()) words.push_back(asciiLower(word));
+    }
+    return words;
+}
+
+// The index term a lowercased word is searched by: its stem, or empty for
+// a stop word
+string indexTerm(const string& word) {
+    return StopWords::contains(word) ? string() : PorterStemmer::stem(word);
+}
+
+// The index terms of a text in order, stop words left out. Products are
+// indexed and queries are matched through this one function.
+vector<string> analyzeWords(const string& text) {
+    vector<string> terms;
+    for (const string& word : surfaceWords(text)) {
+        string term = indexTerm(word);
+        if (!term.empty()) terms.push_back(move(term));
+    }
+    return terms;
+}
+
+// A query split into the free text that is scored and filter conjuncts
+struct ParsedQuery {
+    string text;
+    vector<QueryPlanNode> filters;
+};
+
+// Whitespace-separated tokens; double quotes group words and are dropped
+vector<string> tokenizeQuery(const string& query) {
+    vector<string> tokens;
+    string token;
+    bool quoted = false;
+    for (char c : query) {
+        if (c == '"') {
+            quoted = !quoted;
+        } else if (isspace(static_cast<unsigned char>(c)) && !quoted) {
+            if (!token.empty()) tokens.push_back(token);
+            token.clear();
+        } else {
+            token += c;
+        }
+    }
+    if (!token.empty()) tokens.push_back(token);
+    return tokens;
+}
+
+// Parse one field-scoped token such as brand:apple, brand:apple,samsung,
+// category:"smart phones", inStock:true, price<1500, rating>=4.5 or
+// price:100..500. Returns false for anything else, which stays free text.
+bool parseFilterToken(const string& token, QueryPlanNode& node) {
+    size_t nameEnd = 0;
+    while (nameEnd < token.size() && isalpha(static_cast<unsigned char>(token[nameEnd]))) nameEnd++;
+    string name = asciiLower(token.substr(0, nameEnd));
+
+    int facet = -1;
+    for (int f = 0; f < FACET_COUNT; f++) {
+        if (name == asciiLower(FACET_NAMES[f])) facet = f;
+    }
+    if (facet < 0 || nameEnd == token.size()) return false;
+
+    size_t valueStart = nameEnd + 1;
+    string op(1, token[nameEnd]);
+    if (valueStart < token.size() && token[valueStart] == '=' && (op == "<" || op == ">")) {
+        op += '=';
+        valueStart++;
+    }
+    string value = asciiLower(token.substr(valueStart));
+    if (value.empty() || (op != ":" && op != "=" && op != "<" && op != "<=" && op != ">" && op != ">=")) {
+        return false;
+    }
+
+    if (facet != FACET_PRICE && facet != FACET_RATING) {
+        if (op != ":" && op != "=") return false;
+        if (facet == FACET_STOCK) {
+            if (value == "yes") value = "true";
+            if (value == "no") value = "false";
+            if (value != "true" && value != "false") return false;
+        }
+        vector<QueryPlanNode> values;
+        stringstream list(value);
+        string item;
+        while (getline(list, item, ',')) {
+            if (!item.empty()) values.push_back(QueryPlanNode::leaf(QueryPlanNode::FACET_VALUE, facet, item));
+        }
+        if (values.empty()) return false;
+        node = values.size() == 1 ? values[0] : QueryPlanNode::combine(QueryPlanNode::OR, move(values));
+        return true;
+    }
+
+    auto number = [](const string& text, double& out) {
+        char* end = nullptr;
+        out = strtod(text.c_str(), &end);
+        return !text.empty() && end == text.c_str() + text.size();
+    };
+    NumericRange range;
+    size_t dots = value.find("..");
+    if (op == ":" && dots != string::npos) {
+        string low = value.substr(0, dots);
+        string high = value.substr(dots + 2);
+        if ((!low.empty() && !number(low, range.min)) || (!high.empty() && !number(high, range.max))) return false;
+    } else {
+        double bound;
+        if (!number(value, bound)) return false;
+        if (op == ":" || op == "=") range.min = range.max = bound;
+        if (op[0] == '<') range.max = bound;
+        if (op[0] == '>') range.min = bound;
+        if (op == "<") range.maxInclusive = false;
+        if (op == ">") range.minInclusive = false;
+    }
+    node = QueryPlanNode::leaf(QueryPlanNode::RANGE, facet, "");
+    node.range = range;
+    return true;
+}
+
+// Largest ~N accepted on a proximity phrase
+static constexpr uint32_t MAX_PHRASE_SLOP = 32;
+
+// Split a query into free text and filters. A leading '-' negates a filter,
+// or excludes products containing a word (-refurbished). A quoted phrase
+// ("wireless mouse") is required to appear as written, and a proximity
+// phrase ("wireless mouse"~3) with at most that many words in between; its
+// words are scored as free text too.
+ParsedQuery parseQuery(const string& query) {
+    ParsedQuery parsed;
+    for (const string& token : tokenizeQuery(query)) {
+        bool negated = token.size() > 1 && token[0] == '-';
+        string body = negated ? token.substr(1) : token;
+
+        QueryPlanNode node;
+        if (!parseFilterToken(body, node)) {
+            // Only quoting leaves whitespace in a token
+            bool phrase = body.find_first_of(" \t\n\r\f\v") != string::npos;
+            if (!negated && !phrase) {
+                if (!parsed.text.empty()) parsed.text += ' ';
+                parsed.text += token;
+                continue;
+            }
+            uint32_t slop = 0;
+            size_t tilde = body.rfind('~');
+            if (phrase && tilde != string::npos && tilde + 1 < body.size() &&
+                all_of(body.begin() + tilde + 1, body.end(), [](char c) { return isdigit(c); })) {
+                slop = static_cast<uint32_t>(min<unsigned long>(strtoul(body.c_str() + tilde + 1, nullptr, 10),
+                                                                MAX_PHRASE_SLOP));
+                body.erase(tilde);
+            }
+            string words;
+            size_t wordCount = 0;
+            for (const string& term : analyzeWords(body)) {
+                words += (wordCount++ ? " " : "") + term;
+            }
+            if (!wordCount) continue;
+            if (!negated) {
+                // The words as typed: the text is analyzed again when scored,
+                // and stemming a stem can change it ("lenses" -> "lens" -> "len")
+                for (const string& word : surfaceWords(body)) {
+                    if (!parsed.text.empty()) parsed.text += ' ';
+                    parsed.text += word;
+                }
+            }
+            node = QueryPlanNode::leaf(wordCount == 1 ? QueryPlanNode::TERM : QueryPlanNode::PHRASE, -1, words);
+            node.slop = slop;
+        }
+        parsed.filters.push_back(negated ? QueryPlanNode::combine(QueryPlanNode::NOT, {node}) : node);
+    }
+    if (parsed.filters.empty()) parsed.text = query;  // plain queries match exactly as typed
+    return parsed;
+}
+
+// Sidebar filters as plan conjuncts
+vector<QueryPlanNode> filterConjuncts(const FacetFilter& filter) {
+    vector<QueryPlanNode> conjuncts;
+    for (int facet = 0; facet < FACET_COUNT; facet++) {
+        vector<QueryPlanNode> values;
+        for (const string& value : filter.include[facet]) {
+            values.push_back(QueryPlanNode::leaf(QueryPlanNode::FACET_VALUE, facet, asciiLower(value)));
+        }
+        if (values.size() == 1) conjuncts.push_back(values[0]);
+        if (values.size() > 1) conjuncts.push_back(QueryPlanNode::combine(QueryPlanNode::OR, move(values)));
+        for (const string& value : filter.exclude[facet]) {
+            conjuncts.push_back(QueryPlanNode::combine(
+                QueryPlanNode::NOT, {QueryPlanNode::leaf(QueryPlanNode::FACET_VALUE, facet, asciiLower(value))}));
+        }
+    }
+    for (int facet : {FACET_PRICE, FACET_RATING}) {
+        const NumericRange& range = facet == FACET_PRICE ? filter.price : filter.rating;
+        if (!range.bounded()) continue;
+        QueryPlanNode node = QueryPlanNode::leaf(QueryPlanNode::RANGE, facet, "");
+        node.range = range;
+        conjuncts.push_back(node);
+    }
+    return conjuncts;
+}
+
+// When a query has to answer by; unlimited unless given a budget. Long loops
+// poll it every POLL_INTERVAL steps rather than reading the clock each time.
+struct Deadline {
+    static constexpr size_t POLL_INTERVAL = 256;
+
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point at = chrono::steady_clock::time_point::max();
+
+    static chrono::microseconds budgetFromMs(double milliseconds) {
+        return chrono::duration_cast<chrono::microseconds>(chrono::duration<double, milli>(milliseconds));
+    }
+
+    // A budget of zero or less means no deadline
+    static Deadline after(chrono::microseconds budget) {
+        Deadline deadline;
+        if (budget.count() > 0) {
+            deadline.start = chrono::steady_clock::now();
+            deadline.at = deadline.start + budget;
+        }
+        return deadline;
+    }
+
+    // The point fraction of the way through the budget
+    Deadline portion(double fraction) const {
+        if (!limited()) return *this;
+        Deadline deadline = *this;
+        deadline.at = start + chrono::duration_cast<chrono::steady_clock::duration>((at - start) * fraction);
+        return deadline;
+    }
+
+    // This deadline, or fraction of the budget from now when that is later
+    Deadline atLeast(double fraction) const {
+        if (!limited()) return *this;
+        Deadline deadline = *this;
+        auto floor = chrono::steady_clock::now() +
+                     chrono::duration_cast<chrono::steady_clock::duration>((at - start) * fraction);
+        deadline.at = max(at, floor);
+        return deadline;
+    }
+
+    bool limited() const {
+        return at != chrono::steady_clock::time_point::max();
+    }
+
+    bool passed() const {
+        return limited() && chrono::steady_clock::now() >= at;
+    }
+
+    // passed(), but only reading the clock on every POLL_INTERVAL-th step
+    bool passedAt(size_t step) const {
+        return step % POLL_INTERVAL == 0 && passed();
+    }
+};
+
+// Where a page of results ended, in ranking order (score, then product key,
+// both descending). The next page ranks only what comes after it, so a page
+// costs one top-K pass however deep it is.
+struct ResultCursor {
+    double score = HUGE_VAL;
+    int productId = INT_MAX;
+
+    bool active() const {
+        return score != HUGE_VAL || productId != INT_MAX;
+    }
+
+    // Ranked after the cursor
+    bool admits(const pair<double, int>& entry) const {
+        return entry < make_pair(score, productId);
+    }
+};
+
+// Per-query options; the defaults serve the CLI and plain-text daemon queries
+struct SearchOptions {
+    EvaluationMode mode = EvaluationMode::Wand;
+    FacetFilter filter;
+    Deadline deadline;
+    size_t limit = 0;    // results to return; 0 for the query's default
+    size_t offset = 0;   // results skipped, counted after the cursor
+    ResultCursor after;  // return only results ranked after this
+};
+
+// Work done by one query, reported when a request asks for stats
+struct SearchStats {
+    size_t postingsTotal = 0;    // postings across every scored list
+    size_t postingsScored = 0;
+    size_t postingsSkipped = 0;  // passed over without being scored
+    size_t blocksSkipped = 0;    // candidates ruled out by block maxima
+    size_t docsScored = 0;
+    bool degraded = false;       // the deadline cut a matching strategy short
+};
+
+// What a frozen index holds, for size reports
+struct IndexSizes {
+    size_t trieNodes = 0;
+    size_t terms = 0;
+    size_t postings = 0;
+    size_t positions = 0;
+    size_t completions = 0;
+    size_t memoryBytes = 0;
+};
+
+// What a catalog with incremental updates hides from one of its indexes:
+// base docs an update replaced or removed, and direct prefix matches less
+// popular than the merged catalog's first matches
+struct SearchMask {
+    const RoaringBitmap* removedDocs = nullptr;
+    int minDirectPopularity = INT_MIN;
+};
+
+// Postings per block in every scored list; each block records its last doc
+// and highest impact so evaluation can skip it without reading it
+static constexpr uint32_t POSTING_BLOCK_SIZE = 64;
+static constexpr uint32_t END_OF_LIST = UINT32_MAX;
+
+// One input to query evaluation: doc-ordered postings with an impact each,
+// scaled by weight. Term lists point into the inverted index; prefix and
+// fuzzy hits are gathered per query and own their arrays.
+struct ScoredList {
+    const uint32_t* docs = nullptr;
+    const float* impacts = nullptr;
+    const uint32_t* blockLastDocs = nullptr;
+    const float* blockMaxImpacts = nullptr;
+    uint32_t size = 0;
+    double weight = 1.0;
+    float maxImpact = 0.0f;
+
+    vector<uint32_t> ownedDocs;
+    vector<float> ownedImpacts;
+    vector<uint32_t> ownedBlockLastDocs;
+    vector<float> ownedBlockMaxImpacts;
+
+    ScoredList() = default;
+    ScoredList(ScoredList&&) = default;  // moving keeps the owned buffers in place
+    ScoredList& operator=(ScoredList&&) = default;
+    ScoredList(const ScoredList&) = delete;
+    ScoredList& operator=(const ScoredList&) = delete;
+};
+
+// Append the block summaries of one doc-ordered list, to a query's own
+// vectors or the index's arrays
+template <typename DocArray, typename ImpactArray>
+void appendPostingBlocks(const uint32_t* docs, const float* impacts, size_t count,
+                         DocArray& blockLastDocs, ImpactArray& blockMaxImpacts) {
+    for (size_t begin = 0; begin < count; begin += POSTING_BLOCK_SIZE) {
+        size_t end = min<size_t>(count, begin + POSTING_BLOCK_SIZE);
+        blockLastDocs.push_back(docs[end - 1]);
+        blockMaxImpacts.push_back(*max_element(impacts + begin, impacts + end));
+    }
+}
+
+// Position in a ScoredList during document-at-a-time evaluation
+struct ListCursor {
+    const ScoredList* list;
+    uint32_t position = 0;
+
+    uint32_t doc() const { return position < list->size ? list->docs[position] : END_OF_LIST; }
+    double score() const { return list->weight * list->impacts[position]; }
+    double maxScore() const { return list->weight * list->maxImpact; }
+
+    // Block that would hold target, searched from the current block on
+    uint32_t blockFor(uint32_t target) const {
+        uint32_t block = position / POSTING_BLOCK_SIZE;
+        uint32_t blockCount = (list->size + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+        const uint32_t* lastDocs = list->blockLastDocs;
+        if (block >= blockCount || lastDocs[block] >= target) return block;
+        return static_cast<uint32_t>(lower_bound(lastDocs + block + 1, lastDocs + blockCount, target) - lastDocs);
+    }
+
+    // Upper bound for target in this list, and the last doc that bound covers,
+    // without moving the cursor
+    double blockMaxScore(uint32_t target, uint32_t& blockLastDoc) const {
+        uint32_t block = blockFor(target);
+        if (block * POSTING_BLOCK_SIZE >= list->size) {
+            blockLastDoc = END_OF_LIST - 1;
+            return 0.0;
+        }
+        blockLastDoc = list->blockLastDocs[block];
+        return list->weight * list->blockMaxImpacts[block];
+    }
+
+    // Move to the first posting at or after target: whole blocks are passed
+    // on their last doc, then one block is binary searched
+    void advanceTo(uint32_t target) {
+        uint32_t block = blockFor(target);
+        uint32_t from = max(position, block * POSTING_BLOCK_SIZE);
+        if (from >= list->size) {
+            position = list->size;
+            return;
+        }
+        uint32_t to = min(list->size, from / POSTING_BLOCK_SIZE * POSTING_BLOCK_SIZE + POSTING_BLOCK_SIZE);
+        position = static_cast<uint32_t>(lower_bound(list->docs + from, list->docs + to, target) - list->docs);
+    }
+};
+
+// Build-time trie node. Nodes live in one arena vector and link by index;
+// siblings are kept sorted by label so freezing can emit sorted child arrays.
 struct TrieNode {
-    unordered_map<char, TrieNode*> children;
-    set<pair<int, int>> products;  // (popularity, product key)
+    uint32_t firstChild = 0;        // 0 = no children (the root is never a child)
+    uint32_t nextSibling = 0;
+    char label = 0;
     bool isEndOfWord = false;
+    vector<pair<int, int>> products;  // (popularity, doc) of terms ending here
+};
+
+// Frozen, path-compressed trie node. Nodes are stored breadth-first, so the
+// children of a node are contiguous and a lookup scans one small byte array.
+struct FlatTrieNode {
+    uint32_t labelOffset = 0;       // edge label in EnhancedTrie::labels
+    uint32_t firstChild = 0;
+    uint32_t postingOffset = 0;     // top-K (popularity, doc) run in EnhancedTrie::postings
+    uint32_t overflowOffset = 0;    // full list for the term ending here, if any
+    uint32_t overflowCount = 0;
+    uint32_t termId = UINT32_MAX;   // inverted-index term ending here, if any
+    uint32_t completionOffset = 0;  // typeahead run in EnhancedTrie::completionRuns
+    uint16_t postingCount = 0;      // <= EnhancedTrie::TOP_K
+    uint16_t labelLength = 0;
+    uint16_t childCount = 0;
+    uint8_t completionCount = 0;    // <= EnhancedTrie::TYPEAHEAD_TOP_N
+    bool isEndOfWord = false;
+};
+
+// Strings numbered by id and stored back to back, plus the ids in text order
+// so a lookup is a binary search. Frozen indexes use it where the build
+// uses a hash map, since it maps from an index file as is.
+struct StringTable {
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+    IndexArray<char> chars;
+    IndexArray<uint32_t> offsets;  // size() + 1 entries
+    IndexArray<uint32_t> sorted;   // ids ordered by text
+
+    void build(const vector<string>& texts) {
+        chars.clear();
+        offsets.assign(1, 0);
+        sorted.clear();
+        for (uint32_t id = 0; id < texts.size(); id++) {
+            chars.insert(chars.end(), texts[id].begin(), texts[id].end());
+            offsets.push_back(static_cast<uint32_t>(chars.size()));
+            sorted.push_back(id);
+        }
+        sort(sorted.begin(), sorted.end(), [this](uint32_t a, uint32_t b) { return text(a) < text(b); });
+        chars.shrink_to_fit();
+    }
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+    string_view text(uint32_t id) const {
+        return string_view(chars.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    uint32_t find(string_view key) const {
+        auto it = lower_bound(sorted.begin(), sorted.end(), key,
+                              [this](uint32_t id, string_view k) { return text(id) < k; });
+        return it != sorted.end() && text(*it) == key ? *it : NOT_FOUND;
+    }
+
+    size_t memoryBytes() const {
+        return chars.capacity() + (offsets.capacity() + sorted.capacity()) * sizeof(uint32_t);
+    }
+};
+
+// Read-only mapping of a whole file. Pages load on first touch and are
+// shared through the page cache with every process mapping the same file.
+class MappedFile {
+public:
+    static unique_ptr<MappedFile> open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Could not open " << path << ": " << strerror(errno) << endl;
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size == 0) {
+            cerr << "Could not size " << path << endl;
+            close(fd);
+            return nullptr;
+        }
+        void* base = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);  // the mapping keeps the file alive
+        if (base == MAP_FAILED) {
+            cerr << "Could not map " << path << ": " << strerror(errno) << endl;
+            return nullptr;
+        }
+        return unique_ptr<MappedFile>(new MappedFile(static_cast<const char*>(base), info.st_size));
+    }
+
+    ~MappedFile() { munmap(const_cast<char*>(base), length); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const char* base, size_t length) : base(base), length(length) {}
+
+    const char* base;
+    size_t length;
+};
+
+// 64-bit checksum for index files: four independent multiply-rotate lanes
+// over 8-byte words, so it runs near memory speed, then a final avalanche
+static uint64_t checksumBytes(const char* data, size_t size) {
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t lanes[4] = {prime, prime ^ 1, prime ^ 2, prime ^ 3};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, data + i + lane * 8, 8);
+            lanes[lane] = ((lanes[lane] ^ word) * prime);
+            lanes[lane] = (lanes[lane] << 31) | (lanes[lane] >> 33);
+        }
+    }
+    uint64_t hash = size;
+    for (uint64_t lane : lanes) hash = (hash ^ lane) * prime;
+    for (; i < size; i++) hash = (hash ^ static_cast<unsigned char>(data[i])) * prime;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 32);
+}
+
+// Index file layout: this header, a table of sections, then the sections,
+// each starting on an INDEX_SECTION_ALIGNMENT boundary so a mapped index
+// reads them in place. Sections hold the frozen arrays in a fixed order.
+static constexpr char INDEX_FILE_MAGIC[8] = "ECOMIDX";
+static constexpr uint32_t INDEX_FILE_VERSION = 4;
+static constexpr size_t INDEX_SECTION_ALIGNMENT = 64;
+
+struct IndexFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t layout;          // sizes and constants the sections depend on
+    uint64_t fileBytes;
+    uint64_t productCount;
+    double maxRatingBoost;
+    uint64_t headerChecksum;  // over this header, with this field zero, and the section table
+};
+
+struct IndexFileSection {
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t checksum;
+};
+
+// One facet's values: label -> value id -> docs with that value. Labels are
+// numbered through a hash map while building and looked up in a sorted
+// table once frozen.
+struct FacetIndex {
+    StringTable values;
+    vector<RoaringBitmap> docs;
+    unordered_map<string, uint32_t> ids;  // build time only
+    vector<string> labels;                // build time only
+
+    uint32_t valueId(const string& value) {
+        auto [it, added] = ids.emplace(value, static_cast<uint32_t>(labels.size()));
+        if (added) {
+            labels.push_back(value);
+            docs.emplace_back();
+        }
+        return it->second;
+    }
+
+    void freeze() {
+        values.build(labels);
+        unordered_map<string, uint32_t>().swap(ids);
+        vector<string>().swap(labels);
+    }
+
+    const RoaringBitmap* find(const string& value) const {
+        uint32_t id = values.find(value);
+        return id == StringTable::NOT_FOUND ? nullptr : &docs[id];
+    }
+};
+
+// A fixed set of worker threads. run() hands tasks 0..count-1 to the
+// workers and the calling thread and returns once all are done; jobs from
+// different callers take turns. A task must not call run() itself.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t threads) {
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) worker.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Threads a job runs on, the caller included
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // Run every task; rethrows the first exception a task threw
+    void run(size_t count, const function<void(size_t)>& task) {
+        lock_guard<mutex> turn(runMutex);
+        {
+            lock_guard<mutex> lock(stateMutex);
+            job = &task;
+            jobCount = count;
+            nextTask = 0;
+            failure = nullptr;
+            running = workers.size();
+            jobSerial++;
+        }
+        wake.notify_all();
+        drain();
+
+        unique_lock<mutex> lock(stateMutex);
+        finished.wait(lock, [this]() { return running == 0; });
+        job = nullptr;
+        if (failure) rethrow_exception(failure);
+    }
+
+    // Worker count for a --threads option: hardware threads when 0
+    static size_t threadsFor(size_t requested) {
+        return requested ? requested : max<size_t>(1, thread::hardware_concurrency());
+    }
+
+private:
+    vector<thread> workers;
+    mutex runMutex;
+    mutex stateMutex;
+    condition_variable wake;
+    condition_variable finished;
+    const function<void(size_t)>* job = nullptr;
+    size_t jobCount = 0;
+    atomic<size_t> nextTask{0};
+    size_t running = 0;  // workers still on the current job
+    uint64_t jobSerial = 0;
+    bool stopping = false;
+    exception_ptr failure;
+
+    void drain() {
+        for (size_t task; (task = nextTask.fetch_add(1)) < jobCount;) {
+            try {
+                (*job)(task);
+            } catch (...) {
+                lock_guard<mutex> lock(stateMutex);
+                if (!failure) failure = current_exception();
+            }
+        }
+    }
+
+    void work() {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> lock(stateMutex);
+                wake.wait(lock, [this, seen]() { return stopping || jobSerial != seen; });
+                if (stopping) return;
+                seen = jobSerial;
+            }
+            drain();
+            lock_guard<mutex> lock(stateMutex);
+            if (--running == 0) finished.notify_one();
+        }
+    }
+};
+
+// Enhanced Trie Class with multiple indexing strategies
+class EnhancedTrie {
+public:
+    
+    EnhancedTrie() : buildNodes(1) {
+        // Band facets get their values up front, so value id == band index
+        for (size_t band = 0; band <= PRICE_BANDS.size(); band++) {
+            facets[FACET_PRICE].valueId(bandLabel(PRICE_BANDS.data(), PRICE_BANDS.size(), band));
+        }
+        for (size_t band = 0; band <= RATING_BANDS.size(); band++) {
+            facets[FACET_RATING].valueId(bandLabel(RATING_BANDS.data(), RATING_BANDS.size(), band));
+        }
+        facets[FACET_STOCK].valueId("true");
+        facets[FACET_STOCK].valueId("false");
+    }
+
+    EnhancedTrie(const EnhancedTrie&) = delete;
+    EnhancedTrie& operator=(const EnhancedTrie&) = delete;
+    
+    // Helper function to convert string to lowercase
+    static string toLowerCase(const string& str) {
+        string lowerStr = str;
+        transform(lowerStr.begin(), lowerStr.end(), lowerStr.begin(), ::tolower);
+        return lowerStr;
+    }
+
+    // Helper function to split string into words: the index terms of
+    // analyzeWords, stemmed with stop words left out
+    static vector<string> splitWords(const string& str) {
+        return analyzeWords(str);
+    }
+
+    // Insert a single term into the build arena. Postings are recorded only
+    // where the term ends; prefix nodes get their top-K when the trie is frozen.
+    void insertTerm(const string& term, int popularity, uint32_t doc) {
+        string lowerTerm = toLowerCase(term);
+        uint32_t node = 0;
+        for (char c : lowerTerm) {
+            node = findOrAddChild(node, c);
+        }
+        buildNodes[node].products.push_back({-popularity, static_cast<int>(doc)});
+        buildNodes[node].isEndOfWord = true;
+    }
+
+    // Enhanced insert function that indexes multiple aspects of a product.
+    // Products are numbered densely in insertion order; every index refers
+    // to them by that doc number and docKeys maps back to product keys.
+    void insertProduct(const Product& product) {
+        if (docOfKey.count(product.key)) {
+            cerr << "Duplicate product key " << product.key << " ignored" << endl;
+            return;
+        }
+        uint32_t doc = static_cast<uint32_t>(docKeys.size());
+        docOfKey[product.key] = doc;
+        docKeys.push_back(product.key);
+        docRatings.push_back(product.rating);
+        docPrices.push_back(product.price);
+        int popularity = static_cast<int>(product.rating * 100);
+        indexFields(doc, product);
+        indexText(doc, product);
+        indexFacets(doc, product);
+        
+        // 1. Index full product name
+        insertTerm(product.name, popularity, doc);
+        
+        // 2. Index individual words from product name
+        vector<string> nameWords = splitWords(product.name);
+        for (const string& word : nameWords) {
+            insertTerm(word, popularity, doc);
+        }
+        
+        // 3. Index brand, plus its words so every scored term is a trie term
+        if (!product.brand.empty()) {
+            insertTerm(product.brand, popularity, doc);
+            for (const string& word : splitWords(product.brand)) {
+                insertTerm(word, popularity, doc);
+            }
+        }
+        
+        // 4. Index category, plus its words
+        if (!product.category.empty()) {
+            insertTerm(product.category, popularity, doc);
+            for (const string& word : splitWords(product.category)) {
+                insertTerm(word, popularity, doc);
+            }
+        }
+        
+        // 5. Index words from description (optional - might make search too broad)
+        for (const string& word : surfaceWords(product.description)) {
+            if (word.length() > 3) {  // Only index longer words from description, as typed
+                string term = indexTerm(word);
+                if (!term.empty()) insertTerm(term, popularity / 2, doc);  // Lower priority for description matches
+            }
+        }
+    }
+
+    // Insert a catalog on every thread of the pool. Contiguous slices of
+    // the products are indexed into separate shard tries at once, then
+    // merged pairwise, each merge split into independent parts. Merging in
+    // slice order numbers docs, terms and facet values exactly as inserting
+    // the products one at a time here would.
+    void insertProducts(const vector<Product>& products, WorkerPool& pool) {
+        // Repeated keys are dropped up front, so no two shards hold one key
+        vector<const Product*> accepted;
+        unordered_set<int> seen;
+        for (const Product& product : products) {
+            if (docOfKey.count(product.key) || !seen.insert(product.key).second) {
+                cerr << "Duplicate product key " << product.key << " ignored" << endl;
+                continue;
+            }
+            accepted.push_back(&product);
+        }
+
+        size_t shardCount = min(pool.size(), max<size_t>(1, accepted.size() / MIN_SHARD_PRODUCTS));
+        if (shardCount == 1) {
+            for (const Product* product : accepted) insertProduct(*product);
+            return;
+        }
+
+        // Shard 0 is this trie; its docs stay first
+        vector<unique_ptr<EnhancedTrie>> shards(shardCount);
+        for (size_t shard = 1; shard < shardCount; shard++) shards[shard] = make_unique<EnhancedTrie>();
+        auto shardTrie = [this, &shards](size_t shard) -> EnhancedTrie& {
+            return shard == 0 ? *this : *shards[shard];
+        };
+        pool.run(shardCount, [&](size_t shard) {
+            size_t begin = accepted.size() * shard / shardCount;
+            size_t end = accepted.size() * (shard + 1) / shardCount;
+            for (size_t i = begin; i < end; i++) shardTrie(shard).insertProduct(*accepted[i]);
+        });
+
+        for (size_t width = 1; width < shardCount; width *= 2) {
+            vector<pair<size_t, size_t>> merges;  // (into, from), from's slice right after into's
+            vector<uint32_t> docOffsets;
+            for (size_t into = 0; into + width < shardCount; into += 2 * width) {
+                merges.push_back({into, into + width});
+                docOffsets.push_back(static_cast<uint32_t>(shardTrie(into).docKeys.size()));
+            }
+            pool.run(merges.size() * MERGE_PARTS, [&](size_t task) {
+                auto [into, from] = merges[task / MERGE_PARTS];
+                shardTrie(into).absorb(shardTrie(from), docOffsets[task / MERGE_PARTS], task % MERGE_PARTS);
+            });
+            for (const auto& merge : merges) shards[merge.second].reset();
+        }
+    }
+
+    // Compact the build arena into the breadth-first radix layout used by
+    // every query. Chains of single-child, non-terminal nodes are merged into
+    // one edge: such a node holds exactly the postings of its only child.
+    // A delta index of updated products is frozen against its base
+    // (collection), whose document frequencies and field lengths it scores
+    // with, so its BM25F impacts compare with the base's. The collection's
+    // masked docs, those updates replaced or removed, are not counted.
+    void freeze(const EnhancedTrie* collection = nullptr, const vector<uint32_t>* collectionMasked = nullptr) {
+        WorkerPool callerOnly(1);
+        freeze(callerOnly, collection, collectionMasked);
+    }
+
+    // freeze, with the steps that do not depend on each other on the pool
+    void freeze(WorkerPool& pool, const EnhancedTrie* collection = nullptr,
+                const vector<uint32_t>* collectionMasked = nullptr) {
+        nodes.clear();
+        childBytes.clear();
+        labels.clear();
+        postings.clear();
+        overflowPostings.clear();
+
+        nodes.push_back(FlatTrieNode{});
+        childBytes.push_back(0);
+        vector<uint32_t> frontier = {0};  // build node behind each flat node
+        vector<uint32_t> parents = {0};   // flat parent of each flat node
+        for (size_t flat = 0; flat < nodes.size(); flat++) {
+            uint32_t built = frontier[flat];
+            nodes[flat].firstChild = static_cast<uint32_t>(nodes.size());
+            for (uint32_t child = buildNodes[built].firstChild; child;
+                 child = buildNodes[child].nextSibling) {
+                FlatTrieNode edge;
+                edge.labelOffset = static_cast<uint32_t>(labels.size());
+                uint32_t tail = child;
+                labels.push_back(buildNodes[tail].label);
+                while (!buildNodes[tail].isEndOfWord && buildNodes[tail].firstChild &&
+                       !buildNodes[buildNodes[tail].firstChild].nextSibling &&
+                       labels.size() - edge.labelOffset < UINT16_MAX) {
+                    tail = buildNodes[tail].firstChild;
+                    labels.push_back(buildNodes[tail].label);
+                }
+                edge.labelLength = static_cast<uint16_t>(labels.size() - edge.labelOffset);
+                edge.isEndOfWord = buildNodes[tail].isEndOfWord;
+
+                nodes.push_back(edge);
+                childBytes.push_back(buildNodes[child].label);
+                frontier.push_back(tail);
+                parents.push_back(static_cast<uint32_t>(flat));
+                nodes[flat].childCount++;
+            }
+        }
+
+        // A node's own postings are sorted and deduplicated apart from the
+        // rest of the tree, so that work is spread over the pool first
+        size_t batches = (nodes.size() + NODES_PER_TASK - 1) / NODES_PER_TASK;
+        pool.run(batches, [&](size_t batch) {
+            size_t end = min(nodes.size(), (batch + 1) * NODES_PER_TASK);
+            for (size_t flat = batch * NODES_PER_TASK; flat < end; flat++) {
+                sortOwnPostings(buildNodes[frontier[flat]].products);
+            }
+        });
+
+        // Children follow their parent in breadth-first order, so a reverse
+        // sweep sees every child's top-K before the parent merges them.
+        for (size_t flat = nodes.size(); flat-- > 0;) {
+            emitPostings(nodes[flat], buildNodes[frontier[flat]]);
+        }
+
+        // Completions, the inverted index and the doc-level indexes write
+        // disjoint members and only read the trie
+        pool.run(3, [&](size_t step) {
+            if (step == 0) {
+                buildCompletions(parents);
+            } else if (step == 1) {
+                buildInvertedIndex(collection, collectionMasked);
+            } else {
+                buildTrigramIndex();
+                buildCategoryIndex();
+                freezeFacets();
+                docsByKey.clear();
+                for (uint32_t doc = 0; doc < docKeys.size(); doc++) docsByKey.push_back(doc);
+                sort(docsByKey.begin(), docsByKey.end(),
+                     [this](uint32_t a, uint32_t b) { return docKeys[a] < docKeys[b]; });
+                unordered_map<int, uint32_t>().swap(docOfKey);
+            }
+        });
+
+        vector<TrieNode>().swap(buildNodes);
+        unordered_map<string, string>().swap(termSurfaces);
+        nodes.shrink_to_fit();
+        childBytes.shrink_to_fit();
+        labels.shrink_to_fit();
+        postings.shrink_to_fit();
+        overflowPostings.shrink_to_fit();
+        completionRuns.shrink_to_fit();
+        completionChars.shrink_to_fit();
+    }
+
+    // Write the frozen index for loadIndex. The file is written to a
+    // temporary name and renamed over path, so processes that have the old
+    // file mapped keep reading a consistent index.
+    bool saveIndex(const string& path) const {
+        vector<pair<const char*, size_t>> arrays;
+        forEachIndexArray(*this, [&arrays](const auto& array) {
+            arrays.push_back({reinterpret_cast<const char*>(array.data()), array.size() * sizeof(*array.data())});
+        });
+
+        IndexFileHeader header{};
+        memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+        header.version = INDEX_FILE_VERSION;
+        header.sectionCount = static_cast<uint32_t>(arrays.size());
+        header.layout = indexLayout();
+        header.productCount = docKeys.size();
+        header.maxRatingBoost = maxRatingBoost;
+        vector<IndexFileSection> sections;
+        uint64_t offset = alignSection(sizeof(header) + arrays.size() * sizeof(IndexFileSection));
+        for (const auto& [data, bytes] : arrays) {
+            sections.push_back({offset, bytes, checksumBytes(data, bytes)});
+            offset = alignSection(offset + bytes);
+        }
+        header.fileBytes = offset;
+        header.headerChecksum = headerChecksum(header, sections.data());
+
+        string temporary = path + ".tmp." + to_string(getpid());
+        ofstream file(temporary, ios::binary | ios::trunc);
+        if (!file) {
+            cerr << "Could not create index file " << temporary << endl;
+            return false;
+        }
+        static const char padding[INDEX_SECTION_ALIGNMENT] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(IndexFileSection));
+        uint64_t written = sizeof(header) + sections.size() * sizeof(IndexFileSection);
+        for (size_t i = 0; i < arrays.size(); i++) {
+            file.write(padding, sections[i].offset - written);
+            file.write(arrays[i].first, arrays[i].second);
+            written = sections[i].offset + arrays[i].second;
+        }
+        file.write(padding, header.fileBytes - written);
+        file.close();
+        if (!file || rename(temporary.c_str(), path.c_str()) != 0) {
+            cerr << "Could not write index file " << path << ": " << strerror(errno) << endl;
+            remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Serve an index written by saveIndex from a read-only mapping. Arrays
+    // are used in place, so loading checks the header and section table and
+    // touches nothing else; verifyPayload also checksums every section,
+    // which reads the whole file. Call on a new trie, and discard the trie
+    // if this fails.
+    bool loadIndex(const string& path, bool verifyPayload = false) {
+        auto fail = [&path](const string& reason) {
+            cerr << "Cannot use index " << path << ": " << reason << endl;
+            return false;
+        };
+        unique_ptr<MappedFile> file = MappedFile::open(path);
+        if (!file) return false;
+
+        IndexFileHeader header;
+        if (file->size() < sizeof(header)) return fail("truncated header");
+        memcpy(&header, file->data(), sizeof(header));
+        size_t sectionCount = 0;
+        forEachIndexArray(*this, [&sectionCount](const auto&) { sectionCount++; });
+        if (memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0) return fail("not an index file");
+        if (header.version != INDEX_FILE_VERSION) {
+            return fail("format version " + to_string(header.version) + ", expected " + to_string(INDEX_FILE_VERSION));
+        }
+        if (header.layout != indexLayout() || header.sectionCount != sectionCount) {
+            return fail("written by an incompatible build");
+        }
+        if (header.fileBytes != file->size() ||
+            file->size() < sizeof(header) + sectionCount * sizeof(IndexFileSection)) {
+            return fail("file size does not match its header");
+        }
+        const IndexFileSection* sections = reinterpret_cast<const IndexFileSection*>(file->data() + sizeof(header));
+        if (headerChecksum(header, sections) != header.headerChecksum) return fail("header checksum mismatch");
+
+        string problem;
+        size_t next = 0;
+        forEachIndexArray(*this, [&](const auto& array) {
+            const IndexFileSection& section = sections[next++];
+            if (!problem.empty()) return;
+            if (section.offset % INDEX_SECTION_ALIGNMENT || section.offset > file->size() ||
+                section.bytes > file->size() - section.offset || section.bytes % sizeof(*array.data())) {
+                problem = "section " + to_string(next - 1) + " out of bounds";
+            } else if (verifyPayload && checksumBytes(file->data() + section.offset, section.bytes) != section.checksum) {
+                problem = "section " + to_string(next - 1) + " checksum mismatch";
+            }
+        });
+        if (!problem.empty()) return fail(problem);
+
+        vector<TrieNode>().swap(buildNodes);
+        for (FacetIndex& facet : facets) {
+            unordered_map<string, uint32_t>().swap(facet.ids);
+            vector<string>().swap(facet.labels);
+        }
+        next = 0;
+        forEachIndexArray(*this, [&](auto& array) {
+            using Item = remove_reference_t<decltype(*array.data())>;
+            const IndexFileSection& section = sections[next++];
+            array.map(reinterpret_cast<const Item*>(file->data() + section.offset), section.bytes / sizeof(Item));
+        });
+        mapping = move(file);
+        maxRatingBoost = header.maxRatingBoost;
+
+        size_t bitmaps = 1;
+        for (const FacetIndex& facet : facets) bitmaps += facet.values.size();
+        if (nodes.empty() || docKeys.size() != header.productCount || docsByKey.size() != docKeys.size() ||
+            fieldLengthAverages.size() != FIELD_COUNT || bitmapOffsets.size() != bitmaps + 1) {
+            return fail("sections are inconsistent");
+        }
+        attachBitmaps();
+        return true;
+    }
+
+    // Checksum over every frozen array, equal for equal indexes
+    uint64_t indexChecksum() const {
+        uint64_t checksum = 0;
+        forEachIndexArray(*this, [&checksum](const auto& array) {
+            checksum = checksum * 31 + checksumBytes(reinterpret_cast<const char*>(array.data()),
+                                                     array.size() * sizeof(*array.data()));
+        });
+        return checksum;
+    }
+
+    // Search for products by prefix
+    vector<int> searchByPrefix(const string& prefix) const {
+        vector<int> results;
+        for (uint32_t doc : prefixDocs(toLowerCase(prefix))) {
+            results.push_back(docKeys[doc]);
+        }
+        
+        sort(results.begin(), results.end());
+        return results;
+    }
+
+    // Typeahead: the most popular indexed strings (full names, words, brands,
+    // categories) starting with prefix, read from the node's precomputed run
+    // with no scoring pass
+    vector<string> completions(const string& prefix, size_t limit = TYPEAHEAD_TOP_N) const {
+        vector<string> results;
+        uint32_t node = findPrefixNode(toLowerCase(prefix));
+        if (node == NO_NODE) return results;
+
+        const FlatTrieNode& match = nodes[node];
+        for (uint32_t i = 0; i < match.completionCount && results.size() < limit; i++) {
+            results.push_back(completionText(completionRuns[match.completionOffset + i]));
+        }
+        return results;
+    }
+
+    size_t productCount() const {
+        return docKeys.size();
+    }
+
+    IndexSizes indexSizes() const {
+        IndexSizes sizes;
+        sizes.trieNodes = nodes.size();
+        sizes.terms = termMaxImpacts.size();
+        sizes.postings = postingDocs.size();
+        sizes.positions = positions.size();
+        sizes.completions = completionOffsets.empty() ? 0 : completionOffsets.size() - 1;
+        sizes.memoryBytes = indexMemoryBytes();
+        return sizes;
+    }
+
+    // Bytes held by the frozen index
+    size_t indexMemoryBytes() const {
+        return nodes.capacity() * sizeof(FlatTrieNode) + childBytes.capacity() +
+               labels.capacity() +
+               (postings.capacity() + overflowPostings.capacity()) * sizeof(pair<int, int>) +
+               (termPostingOffsets.capacity() + termBlockOffsets.capacity() + blockLastDocs.capacity()) *
+                   sizeof(uint32_t) +
+               (blockMaxImpacts.capacity() + termMaxImpacts.capacity()) * sizeof(float) +
+               postingDocs.capacity() * sizeof(uint32_t) + postingImpacts.capacity() * sizeof(float) +
+               (postingPositionOffsets.capacity() + positions.capacity()) * sizeof(uint32_t) +
+               docKeys.capacity() * sizeof(int) + docRatings.capacity() * sizeof(double) +
+               termChars.capacity() + termTextOffsets.capacity() * sizeof(uint32_t) +
+               deleteIndex.capacity() * sizeof(DeleteEntry) +
+               (trigramKeys.capacity() + trigramOffsets.capacity() + trigramDocs.capacity() +
+                textOffsets.capacity() + categoryOffsets.capacity() + categoryDocs.capacity()) *
+                   sizeof(uint32_t) +
+               textBlob.capacity() + docPrices.capacity() * sizeof(double) + facetMemoryBytes() +
+               categoryNames.memoryBytes() +
+               (completionRuns.capacity() + completionOffsets.capacity()) * sizeof(uint32_t) +
+               completionChars.capacity();
+    }
+
+    // "Did you mean" corrections for a query: every word whose term is not
+    // indexed is replaced by the closest term spelling (fewest edits, then
+    // most documents). Further candidates for the first corrected word give
+    // alternative suggestions. Empty when every word is already a known term;
+    // stop words are kept as typed.
+    vector<string> suggestCorrections(const string& query, size_t limit = 3) const {
+        vector<string> words = surfaceWords(parseQuery(query).text);
+        vector<vector<string>> choices;
+        bool corrected = false;
+        for (const string& word : words) {
+            vector<string> candidates;
+            string term = indexTerm(word);
+            if (!term.empty() && findTerm(term) == NO_TERM) {
+                candidates = spellingCandidates(word, limit);
+            }
+            if (candidates.empty()) {
+                candidates.push_back(word);
+            } else {
+                corrected = true;
+            }
+            choices.push_back(candidates);
+        }
+        if (!corrected) return {};
+
+        vector<string> best;
+        for (const auto& candidates : choices) best.push_back(candidates[0]);
+
+        vector<string> suggestions = {joinWords(best)};
+        for (size_t i = 0; i < choices.size() && suggestions.size() < limit; i++) {
+            for (size_t c = 1; c < choices[i].size() && suggestions.size() < limit; c++) {
+                vector<string> variant = best;
+                variant[i] = choices[i][c];
+                suggestions.push_back(joinWords(variant));
+            }
+            if (choices[i].size() > 1) break;
+        }
+        return suggestions;
+    }
+
+    // Advanced search that combines multiple strategies. Each strategy yields
+    // doc-ordered scored lists; options.mode picks how they are evaluated.
+    // Field-scoped terms in the query (brand:apple price<1500 -refurbished)
+    // and options.filter compile into a filter plan that runs first; when it
+    // leaves few survivors, text matching only looks at those. Facet counts
+    // over every text match are filled in when requested.
+    vector<int> advancedSearch(const string& query, const SearchOptions& options = {},
+                               SearchStats* stats = nullptr, FacetCounts* facetCounts = nullptr) const {
+        vector<int> results;
+        for (const auto& entry : rankedPage(query, options, stats, facetCounts)) {
+            results.push_back(entry.second);
+        }
+        return results;
+    }
+
+    // The page of advancedSearch's ranking that options ask for, as
+    // (score, product key): results after options.after, less the first
+    // options.offset, up to the limit
+    vector<pair<double, int>> rankedPage(const string& query, const SearchOptions& options,
+                                         SearchStats* stats = nullptr, FacetCounts* facetCounts = nullptr) const {
+        size_t limit = options.limit ? options.limit : resultLimit(query);
+        vector<pair<double, int>> ranked = rankedSearch(query, options, options.offset + limit, SearchMask{},
+                                                        stats, facetCounts);
+        ranked.erase(ranked.begin(), ranked.begin() + min(options.offset, ranked.size()));
+        return ranked;
+    }
+
+    // FNV-1a; stable across processes, unlike std::hash
+    static uint64_t hashString(const string& text) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (char c : text) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Results advancedSearch returns for a query unless options.limit says
+    // otherwise: 10, or 50 when the query names a category
+    size_t resultLimit(const string& query) const {
+        return categoryNames.find(toLowerCase(parseQuery(query).text)) != StringTable::NOT_FOUND ? 50 : 10;
+    }
+
+    // advancedSearch's best limit results after options.after as (score,
+    // product key), best first. Docs the mask removes are neither returned
+    // nor counted.
+    vector<pair<double, int>> rankedSearch(const string& query, const SearchOptions& options, size_t limit,
+                                           const SearchMask& mask, SearchStats* stats = nullptr,
+                                           FacetCounts* facetCounts = nullptr) const {
+        const RoaringBitmap* removedDocs = mask.removedDocs;
+        static thread_local SearchScratch scratch;
+        ParsedQuery parsed = parseQuery(query);
+        vector<string> queryWords = splitWords(parsed.text);
+        string lowerQuery = toLowerCase(parsed.text);
+        vector<ScoredList> lists;
+
+        QueryPlanNode plan = compilePlan(parsed.filters, options.filter);
+        bool filtered = !plan.children.empty();
+        RoaringBitmap allowed;
+        if (filtered) allowed = executePlan(plan, nullptr);
+        if (removedDocs && !removedDocs->empty()) {
+            allowed = RoaringBitmap::subtract(filtered ? allowed : allDocs, *removedDocs);
+            filtered = true;
+        }
+        const RoaringBitmap* allowedDocs = filtered ? &allowed : nullptr;
+        // Facet counts need every text match, so they keep the full scans
+        bool narrow = filtered && !facetCounts && allowed.cardinality() * NARROW_FILTER_RATIO < docKeys.size();
+        
+        // Strategy 1: Direct prefix match on full query (names, brands, categories)
+        vector<uint32_t> directDocs = prefixDocs(lowerQuery, removedDocs, mask.minDirectPopularity);
+        sort(directDocs.begin(), directDocs.end());
+        vector<float> directImpacts(directDocs.size(), static_cast<float>(DIRECT_MATCH_BOOST));
+        lists.push_back(ownedList(move(directDocs), move(directImpacts)));
+        
+        // Strategy 2: BM25F over the postings of each query word and its completions
+        for (const string& word : queryWords) {
+            for (const auto& [termId, weight] : expandTerm(word)) {
+                lists.push_back(termList(termId, weight));
+            }
+        }
+
+        // Products holding a multi-word query's words side by side, as typed,
+        // outrank those that merely contain them. Adjacency of words nearly
+        // every product has says little and costs the most to find, so it
+        // is only looked for when one of the words is selective, and not when
+        // the query is a quoted phrase every candidate already holds.
+        string queryTerms;
+        for (const string& word : queryWords) queryTerms += (queryTerms.empty() ? "" : " ") + word;
+        bool quotedAsTyped = any_of(parsed.filters.begin(), parsed.filters.end(), [&](const QueryPlanNode& node) {
+            return node.kind == QueryPlanNode::PHRASE && !node.slop && node.value == queryTerms;
+        });
+        if (queryWords.size() > 1 && !quotedAsTyped) {
+            vector<uint32_t> adjacentDocs = phraseDocs(queryWords, 0, narrow ? &allowed : nullptr,
+                                                       docKeys.size() / PHRASE_BOOST_DOC_RATIO);
+            vector<float> adjacentImpacts(adjacentDocs.size(), static_cast<float>(PHRASE_MATCH_BOOST));
+            lists.push_back(ownedList(move(adjacentDocs), move(adjacentImpacts)));
+        }
+        
+        // Strategy 3: Typo-tolerant prefix matching through the trie, for the
+        // whole query and for each word of a multi-word query. This is the
+        // expensive one, so a query past its deadline skips or cuts it short
+        // and ranks what the strategies found so far. Matching may use the
+        // first MATCH_BUDGET_SHARE of the budget; ranking always keeps the
+        // rest, so a late query still orders its candidates.
+        Deadline deadline = options.deadline.portion(MATCH_BUDGET_SHARE);
+        bool degraded = deadline.passed();
+        ScoreAccumulator& fuzzyScores = scratch.fuzzy;  // best fuzzy credit per doc
+        fuzzyScores.reset(docKeys.size());
+        bool automatonFits = lowerQuery.length() <= LevenshteinAutomaton::MAX_QUERY_LENGTH;
+        if (automatonFits && !degraded) {
+            degraded = collectFuzzyPrefixMatches(lowerQuery, fuzzyScores, deadline) == FuzzyWalk::TIMED_OUT;
+            if (queryWords.size() > 1) {
+                for (const string& word : queryWords) {
+                    if (degraded) break;
+                    degraded = collectFuzzyPrefixMatches(word, fuzzyScores, deadline) == FuzzyWalk::TIMED_OUT;
+                }
+            }
+        }
+
+        // Infix matches ("phone" in "iPhone"): intersect the query's trigram
+        // postings and verify only the survivors. Queries under 3 characters
+        // have no trigram, and queries too long for the automaton also need
+        // the edit-distance fallback, so both still scan, unless a narrow
+        // filter leaves few enough docs to check one by one.
+        MyersMatcher matcher(lowerQuery);
+        int maxEdits = automatonFits ? -1 : maxEditsFor(lowerQuery.length());
+        bool useTrigrams = automatonFits && lowerQuery.length() >= 3;
+        vector<uint32_t> infixDocs;
+        if (degraded) {
+            // Out of time before the infix pass
+        } else if (useTrigrams) {
+            vector<uint32_t> candidates = trigramCandidates(lowerQuery);
+            for (size_t i = 0; i < candidates.size() && !(degraded = deadline.passedAt(i)); i++) {
+                uint32_t doc = candidates[i];
+                if (narrow && !allowed.contains(doc)) continue;
+                if (isApproximateMatch(lowerQuery, matcher, maxEdits, doc)) infixDocs.push_back(doc);
+            }
+        } else if (narrow) {
+            size_t checked = 0;
+            allowed.forEach([&](uint32_t doc) {
+                if (degraded || (degraded = deadline.passedAt(checked++))) return;
+                if (isApproximateMatch(lowerQuery, matcher, maxEdits, doc)) infixDocs.push_back(doc);
+            });
+        } else if (maxEdits < 0) {
+            degraded = !scanTextBlob(lowerQuery, infixDocs, deadline);
+        } else {
+            for (uint32_t doc = 0; doc < docKeys.size() && !(degraded = deadline.passedAt(doc)); doc++) {
+                if (isApproximateMatch(lowerQuery, matcher, maxEdits, doc)) infixDocs.push_back(doc);
+            }
+        }
+        for (uint32_t doc : infixDocs) {
+            fuzzyScores.raise(doc, FUZZY_MATCH_SCORE);
+        }
+        vector<uint32_t> fuzzyDocs;
+        fuzzyScores.touchedInDocOrder(fuzzyDocs);
+        vector<float> fuzzyImpacts;
+        fuzzyImpacts.reserve(fuzzyDocs.size());
+        for (uint32_t doc : fuzzyDocs) {
+            fuzzyImpacts.push_back(static_cast<float>(fuzzyScores.score(doc)));
+        }
+        lists.push_back(ownedList(move(fuzzyDocs), move(fuzzyImpacts)));
+        
+        if (facetCounts) {
+            RoaringBitmap matches;
+            for (const ScoredList& list : lists) {
+                matches = RoaringBitmap::unite(matches, RoaringBitmap::fromSorted(list.docs, list.size));
+            }
+            if (removedDocs) matches = RoaringBitmap::subtract(matches, *removedDocs);
+            *facetCounts = countFacets(matches, parsed.filters, options.filter);
+        }
+
+        // A narrow filter also cuts every scored list down to its survivors,
+        // so ranking never walks postings the filter rejects. Otherwise
+        // ranking drops rejected candidates before scoring them.
+        if (narrow) {
+            vector<uint32_t> survivors = allowed.toVector();
+            for (ScoredList& list : lists) {
+                if (survivors.size() < list.size) list = restrictList(list, survivors);
+            }
+        }
+
+        SearchStats localStats;
+        SearchStats& work = stats ? *stats : localStats;
+        work = SearchStats{};
+        work.degraded = degraded;
+        for (const ScoredList& list : lists) work.postingsTotal += list.size;
+
+        // Best limit docs by score (relevance plus rating boost), then key
+        vector<pair<double, int>>& scoredResults = scratch.ranked;
+        if (options.mode == EvaluationMode::Exhaustive) {
+            rankExhaustive(lists, limit, allowedDocs, options.after, scratch, work);
+        } else {
+            rankWand(lists, limit, options.mode == EvaluationMode::BlockMaxWand, allowedDocs, options.after,
+                     scoredResults, work, options.deadline.atLeast(1 - MATCH_BUDGET_SHARE));
+        }
+        work.postingsSkipped = work.postingsTotal - work.postingsScored;
+        return scoredResults;
+    }
+
+    // The filter plan advancedSearch runs for a query, estimated and ordered
+    QueryPlanNode planQuery(const string& query, const FacetFilter& filter = {}) const {
+        return compilePlan(parseQuery(query).filters, filter);
+    }
+
+    // Dedicated method to get ALL products in a specific category: one probe
+    // into the category index, then a copy of its pre-ranked slice
+    vector<int> searchByCategory(const string& category) const {
+        uint32_t id = categoryNames.find(toLowerCase(category));
+        if (id == StringTable::NOT_FOUND) return {};
+
+        vector<int> results;
+        results.reserve(categoryOffsets[id + 1] - categoryOffsets[id]);
+        for (uint32_t i = categoryOffsets[id]; i < categoryOffsets[id + 1]; i++) {
+            results.push_back(docKeys[categoryDocs[i]]);
+        }
+        
+        return results;
+    }
+
+    // A page of searchByCategory's ranking as (score, product key): up to
+    // limit docs after the cursor, less the first skip, without removedDocs.
+    // The slice is pre-ranked, so the cursor is found by binary search and a
+    // page costs the same however deep it is.
+    vector<pair<double, int>> rankedCategoryPage(const string& category, const ResultCursor& after, size_t skip,
+                                                 size_t limit, const RoaringBitmap* removedDocs) const {
+        uint32_t id = categoryNames.find(toLowerCase(category));
+        if (id == StringTable::NOT_FOUND) return {};
+
+        auto entryAt = [this](uint32_t i) {
+            uint32_t doc = categoryDocs[i];
+            return make_pair(docRatings[doc] * 10, docKeys[doc]);
+        };
+        uint32_t begin = categoryOffsets[id];
+        uint32_t end = categoryOffsets[id + 1];
+        if (after.active()) {
+            uint32_t count = end - begin;
+            while (count > 0) {  // first entry the cursor admits
+                uint32_t half = count / 2;
+                if (!after.admits(entryAt(begin + half))) {
+                    begin += half + 1;
+                    count -= half + 1;
+                } else {
+                    count = half;
+                }
+            }
+        }
+        if (!removedDocs || removedDocs->empty()) {
+            begin += static_cast<uint32_t>(min<size_t>(skip, end - begin));
+            skip = 0;
+        }
+
+        vector<pair<double, int>> ranked;
+        for (uint32_t i = begin; i < end && ranked.size() < limit; i++) {
+            if (removedDocs && removedDocs->contains(categoryDocs[i])) continue;
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            ranked.push_back(entryAt(i));
+        }
+        return ranked;
+    }
+
+    // searchByCategory's ranking as (score, product key), without removedDocs
+    vector<pair<double, int>> rankedCategory(const string& category, const RoaringBitmap* removedDocs) const {
+        uint32_t id = categoryNames.find(toLowerCase(category));
+        if (id == StringTable::NOT_FOUND) return {};
+
+        vector<pair<double, int>> ranked;
+        for (uint32_t i = categoryOffsets[id]; i < categoryOffsets[id + 1]; i++) {
+            uint32_t doc = categoryDocs[i];
+            if (!removedDocs || !removedDocs->contains(doc)) ranked.push_back({docRatings[doc] * 10, docKeys[doc]});
+        }
+        return ranked;
+    }
+
+    // Popularity of each direct prefix match advancedSearch boosts for the
+    // query, most popular first
+    vector<int> directMatchPopularities(const string& query, const RoaringBitmap* removedDocs) const {
+        vector<int> popularities;
+        for (const auto& posting : prefixRun(toLowerCase(parseQuery(query).text), removedDocs)) {
+            popularities.push_back(-posting.first);
+        }
+        return popularities;
+    }
+
+    // Doc of a product key, or NO_DOC
+    uint32_t docOf(int key) const {
+        auto it = lower_bound(docsByKey.begin(), docsByKey.end(), key,
+                              [this](uint32_t doc, int k) { return docKeys[doc] < k; });
+        return it != docsByKey.end() && docKeys[*it] == key ? *it : NO_DOC;
+    }
+
+    bool isKnownTerm(const string& word) const {
+        return findTerm(toLowerCase(word)) != NO_TERM;
+    }
+
+    // Id of a facet value, or StringTable::NOT_FOUND; band values are
+    // numbered in band order
+    uint32_t facetValueId(int facet, const string& value) const {
+        return facets[facet].values.find(value);
+    }
+
+    static constexpr uint32_t NO_DOC = UINT32_MAX;
+
+    // Products per shard below which a parallel build uses fewer shards
+    static constexpr size_t MIN_SHARD_PRODUCTS = 2048;
+    // Trie nodes per task when freezing sorts their postings
+    static constexpr size_t NODES_PER_TASK = 1024;
+
+    // Popularity-ordered postings kept per node; searchByPrefix and the
+    // direct match strategy read the first DIRECT_MATCHES
+    static constexpr size_t TOP_K = 16;
+    static constexpr size_t DIRECT_MATCHES = 15;
+
+    // Completion strings kept per node for typeahead
+    static constexpr size_t TYPEAHEAD_TOP_N = 10;
+
+    // BM25F: per-field boosts and length normalisation, shared saturation k1
+    static constexpr double FIELD_BOOST[FIELD_COUNT] = {3.0, 2.0, 2.0, 1.0};
+    static constexpr double FIELD_B[FIELD_COUNT] = {0.75, 0.25, 0.25, 0.75};
+    static constexpr double BM25_K1 = 1.2;
+
+    // Completions of a query word score below the exact term
+    static constexpr double PREFIX_EXPANSION_WEIGHT = 0.5;
+    static constexpr size_t MAX_EXPANSIONS = 8;
+    static constexpr size_t MAX_EXPANSION_VISITS = 256;
+
+    // Non-BM25F evidence added on top of the text score
+    static constexpr double DIRECT_MATCH_BOOST = 4.0;
+    static constexpr double FUZZY_MATCH_SCORE = 2.0;
+    static constexpr double PHRASE_MATCH_BOOST = 2.0;
+    static constexpr size_t PHRASE_BOOST_DOC_RATIO = 8;  // a boosted phrase has a word in at most 1/8 of docs
+    static constexpr double RATING_WEIGHT = 0.5;  // rating boost per star
+
+    // A filter is narrow, and text matching checks only its survivors, when
+    // it keeps under 1 in NARROW_FILTER_RATIO docs
+    static constexpr size_t NARROW_FILTER_RATIO = 8;
+
+    // Lower bounds of the price and rating facet bands after the first
+    static constexpr array<double, 7> PRICE_BANDS = {25, 50, 100, 250, 500, 1000, 2000};
+    static constexpr array<double, 5> RATING_BANDS = {1, 2, 3, 4, 4.5};
+    static constexpr size_t MAX_FUZZY_VISITS = 50000;
+    static constexpr size_t SCAN_CHUNK = 1 << 20;  // text blob bytes between deadline checks
+    static constexpr double MATCH_BUDGET_SHARE = 0.75;
+
+    // Symmetric-delete spelling index: deletes are taken from at most this
+    // many leading characters of each term (the SymSpell prefix bound)
+    static constexpr size_t SPELLING_PREFIX_LENGTH = 7;
+    static constexpr int MAX_SPELLING_EDITS = 2;
+
+private:
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    vector<TrieNode> buildNodes;           // insertion arena, released by freeze()
+    IndexArray<FlatTrieNode> nodes;        // frozen trie, breadth-first
+    IndexArray<unsigned char> childBytes;  // first label byte of each frozen node
+    IndexArray<char> labels;               // concatenated edge labels
+    IndexArray<pair<int, int>> postings;   // per-node top-K (popularity, doc) runs
+    IndexArray<pair<int, int>> overflowPostings;  // full per-term lists, one entry per product
+
+    // Typeahead: every indexed string, numbered most popular first, and each
+    // node's TYPEAHEAD_TOP_N lowest completion ids in its subtree
+    IndexArray<uint32_t> completionRuns;
+    IndexArray<char> completionChars;
+    IndexArray<uint32_t> completionOffsets;
+
+    // Inverted index: term id -> (doc, BM25F impact) postings in doc order.
+    // Docs are dense indices into docKeys; the trie maps terms to term ids.
+    unordered_map<string, uint32_t> termIds;           // build time only
+    vector<vector<TermOccurrence>> buildPostings;      // build time only
+    vector<vector<uint32_t>> buildPositions;           // build time only, per term in posting order
+    unordered_map<string, string> termSurfaces;        // build time only: term -> shortest spelling
+    vector<array<uint16_t, FIELD_COUNT>> fieldLengths;  // build time only
+    unordered_map<int, uint32_t> docOfKey;  // build time only
+    IndexArray<int> docKeys;
+    IndexArray<uint32_t> docsByKey;         // docs ordered by product key
+    IndexArray<double> fieldLengthAverages;  // per field, as scored
+    IndexArray<double> docRatings;
+    IndexArray<uint32_t> termPostingOffsets;
+    IndexArray<uint32_t> postingDocs;
+    IndexArray<float> postingImpacts;
+
+    // Positional index: posting i's word positions (see POSITION_FIELD_SHIFT)
+    // are positions[postingPositionOffsets[i], postingPositionOffsets[i + 1]),
+    // ascending
+    IndexArray<uint32_t> postingPositionOffsets;
+    IndexArray<uint32_t> positions;
+
+    // Block summaries of every term's postings (see POSTING_BLOCK_SIZE):
+    // term id -> first block, plus each term's highest impact
+    IndexArray<uint32_t> termBlockOffsets;
+    IndexArray<uint32_t> blockLastDocs;
+    IndexArray<float> blockMaxImpacts;
+    IndexArray<float> termMaxImpacts;
+    double maxRatingBoost = 0.0;  // largest rating boost of any doc
+
+    // Slack for score bounds summed in a different order than the scores
+    static constexpr double SCORE_EPSILON = 1e-9;
+
+    // Term spellings by term id (see termSurfaces), for building suggestions
+    IndexArray<char> termChars;
+    IndexArray<uint32_t> termTextOffsets;
+
+    // Symmetric-delete dictionary: FNV-1a hash of each term-prefix delete,
+    // sorted, mapping to the term ids that produce it. The padding is spelled
+    // out so saved indexes hold no uninitialized bytes.
+    struct DeleteEntry {
+        uint64_t hash;
+        uint32_t termId;
+        uint32_t padding = 0;
+
+        bool operator<(const DeleteEntry& other) const {
+            return hash != other.hash ? hash < other.hash : termId < other.termId;
+        }
+        bool operator==(const DeleteEntry& other) const {
+            return hash == other.hash && termId == other.termId;
+        }
+    };
+    IndexArray<DeleteEntry> deleteIndex;
+
+    static constexpr uint32_t NO_TERM = UINT32_MAX;
+
+    // Trigram index over lowercased name, brand and category: packed trigram
+    // -> doc-ordered, per-doc distinct postings
+    unordered_map<uint32_t, vector<uint32_t>> buildTrigrams;  // build time only
+    IndexArray<uint32_t> trigramKeys;     // sorted
+    IndexArray<uint32_t> trigramOffsets;  // trigramKeys.size() + 1 entries
+    IndexArray<uint32_t> trigramDocs;
+
+    // Lowercased name, brand and category of every doc packed back to back,
+    // each field terminated by FIELD_SEPARATOR; doc d spans
+    // [textOffsets[d], textOffsets[d + 1])
+    static constexpr char FIELD_SEPARATOR = '\0';
+    IndexArray<char> textBlob;
+    IndexArray<uint32_t> textOffsets = {0};
+
+    // Facet bitmaps, filled in as products are inserted (docs only grow),
+    // plus every doc for filters that only exclude
+    array<FacetIndex, FACET_COUNT> facets;
+    RoaringBitmap allDocs;
+    IndexArray<double> docPrices;
+
+    // Frozen form of every facet bitmap (allDocs, then each facet's values
+    // in id order): bitmap -> range of stored containers, whose arrays and
+    // bitmaps sit in shared pools. allDocs and facets[].docs read them in place.
+    IndexArray<uint32_t> bitmapOffsets;
+    IndexArray<RoaringBitmap::StoredContainer> bitmapContainers;
+    IndexArray<uint16_t> bitmapLows;
+    IndexArray<uint64_t> bitmapWords;
+
+    // Category index: lowercased category -> id -> docs ranked the way
+    // searchByCategory returns them (rating, then product key, descending)
+    unordered_map<string, uint32_t> categoryIds;  // build time only
+    vector<vector<uint32_t>> buildCategories;     // build time only
+    StringTable categoryNames;
+    IndexArray<uint32_t> categoryOffsets;
+    IndexArray<uint32_t> categoryDocs;
+
+    // Backing file of an index served by loadIndex
+    unique_ptr<MappedFile> mapping;
+
+    // Every frozen array, in index file section order
+    template <typename Trie, typename Visitor>
+    static void forEachIndexArray(Trie& trie, Visitor&& visit) {
+        visit(trie.nodes);
+        visit(trie.childBytes);
+        visit(trie.labels);
+        visit(trie.postings);
+        visit(trie.overflowPostings);
+        visit(trie.completionRuns);
+        visit(trie.completionChars);
+        visit(trie.completionOffsets);
+        visit(trie.docKeys);
+        visit(trie.docsByKey);
+        visit(trie.fieldLengthAverages);
+        visit(trie.docRatings);
+        visit(trie.docPrices);
+        visit(trie.termPostingOffsets);
+        visit(trie.postingDocs);
+        visit(trie.postingImpacts);
+        visit(trie.postingPositionOffsets);
+        visit(trie.positions);
+        visit(trie.termBlockOffsets);
+        visit(trie.blockLastDocs);
+        visit(trie.blockMaxImpacts);
+        visit(trie.termMaxImpacts);
+        visit(trie.termChars);
+        visit(trie.termTextOffsets);
+        visit(trie.deleteIndex);
+        visit(trie.trigramKeys);
+        visit(trie.trigramOffsets);
+        visit(trie.trigramDocs);
+        visit(trie.textBlob);
+        visit(trie.textOffsets);
+        visit(trie.bitmapOffsets);
+        visit(trie.bitmapContainers);
+        visit(trie.bitmapLows);
+        visit(trie.bitmapWords);
+        for (auto& facet : trie.facets) {
+            visit(facet.values.chars);
+            visit(facet.values.offsets);
+            visit(facet.values.sorted);
+        }
+        visit(trie.categoryNames.chars);
+        visit(trie.categoryNames.offsets);
+        visit(trie.categoryNames.sorted);
+        visit(trie.categoryOffsets);
+        visit(trie.categoryDocs);
+    }
+
+    // What the stored sections depend on besides the format version: struct
+    // sizes, byte order, the constants baked into stored runs and the stop
+    // words the terms were analyzed with
+    static uint64_t indexLayout() {
+        string stopWords = StopWords::sorted();
+        const uint64_t facts[] = {sizeof(FlatTrieNode), sizeof(pair<int, int>), sizeof(DeleteEntry),
+                                  sizeof(RoaringBitmap::StoredContainer), sizeof(double), 0x0102030405060708ULL,
+                                  POSTING_BLOCK_SIZE, TOP_K, TYPEAHEAD_TOP_N, SPELLING_PREFIX_LENGTH,
+                                  PRICE_BANDS.size(), RATING_BANDS.size(), FACET_COUNT, POSITION_FIELD_SHIFT,
+                                  checksumBytes(stopWords.data(), stopWords.size())};
+        return checksumBytes(reinterpret_cast<const char*>(facts), sizeof(facts));
+    }
+
+    static uint64_t alignSection(uint64_t offset) {
+        return (offset + INDEX_SECTION_ALIGNMENT - 1) / INDEX_SECTION_ALIGNMENT * INDEX_SECTION_ALIGNMENT;
+    }
+
+    static uint64_t headerChecksum(IndexFileHeader header, const IndexFileSection* sections) {
+        header.headerChecksum = 0;
+        string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(reinterpret_cast<const char*>(sections), header.sectionCount * sizeof(IndexFileSection));
+        return checksumBytes(bytes.data(), bytes.size());
+    }
+
+    // "0-25", "25-50", ... "2000+" for the bands split at bounds
+    static string bandLabel(const double* bounds, size_t count, size_t band) {
+        ostringstream label;
+        label << (band == 0 ? 0.0 : bounds[band - 1]);
+        if (band == count) {
+            label << '+';
+        } else {
+            label << '-' << bounds[band];
+        }
+        return label.str();
+    }
+
+    static size_t bandOf(const double* bounds, size_t count, double value) {
+        return upper_bound(bounds, bounds + count, value) - bounds;
+    }
+
+    void indexFacets(uint32_t doc, const Product& product) {
+        if (!product.brand.empty()) {
+            facets[FACET_BRAND].docs[facets[FACET_BRAND].valueId(toLowerCase(product.brand))].add(doc);
+        }
+        facets[FACET_CATEGORY].docs[facets[FACET_CATEGORY].valueId(toLowerCase(product.category))].add(doc);
+        facets[FACET_PRICE].docs[bandOf(PRICE_BANDS.data(), PRICE_BANDS.size(), product.price)].add(doc);
+        facets[FACET_RATING].docs[bandOf(RATING_BANDS.data(), RATING_BANDS.size(), product.rating)].add(doc);
+        facets[FACET_STOCK].docs[product.stock > 0 ? 0 : 1].add(doc);
+        allDocs.add(doc);
+    }
+
+    size_t facetMemoryBytes() const {
+        size_t bytes = allDocs.memoryBytes() + bitmapOffsets.capacity() * sizeof(uint32_t) +
+                       bitmapContainers.capacity() * sizeof(RoaringBitmap::StoredContainer) +
+                       bitmapLows.capacity() * sizeof(uint16_t) + bitmapWords.capacity() * sizeof(uint64_t);
+        for (const FacetIndex& facet : facets) {
+            bytes += facet.values.memoryBytes();
+            for (const RoaringBitmap& docs : facet.docs) bytes += docs.memoryBytes();
+        }
+        return bytes;
+    }
+
+    // Number the facet labels and move every bitmap into the stored pools
+    void freezeFacets() {
+        bitmapOffsets.assign(1, 0);
+        bitmapContainers.clear();
+        bitmapLows.clear();
+        bitmapWords.clear();
+        auto store = [this](const RoaringBitmap& docs) {
+            docs.store(bitmapContainers, bitmapLows, bitmapWords);
+            bitmapOffsets.push_back(static_cast<uint32_t>(bitmapContainers.size()));
+        };
+        store(allDocs);
+        for (FacetIndex& facet : facets) {
+            facet.freeze();
+            for (const RoaringBitmap& docs : facet.docs) store(docs);
+        }
+        bitmapContainers.shrink_to_fit();
+        bitmapLows.shrink_to_fit();
+        bitmapWords.shrink_to_fit();
+        attachBitmaps();
+    }
+
+    // Point allDocs and the facet bitmaps at the stored pools
+    void attachBitmaps() {
+        size_t bitmap = 0;
+        auto view = [this, &bitmap]() {
+            const RoaringBitmap::StoredContainer* stored = bitmapContainers.data();
+            RoaringBitmap docs = RoaringBitmap::view(stored + bitmapOffsets[bitmap], stored + bitmapOffsets[bitmap + 1],
+                                                     bitmapLows.data(), bitmapWords.data());
+            bitmap++;
+            return docs;
+        };
+        allDocs = view();
+        for (FacetIndex& facet : facets) {
+            facet.docs.clear();
+            for (size_t value = 0; value < facet.values.size(); value++) facet.docs.push_back(view());
+        }
+    }
+
+    // Docs whose value lies in a RANGE node's range. Bands wholly inside come
+    // straight from their bitmaps; only the docs of bands straddling an end
+    // are checked.
+    RoaringBitmap rangeDocs(const QueryPlanNode& node, const IndexArray<double>& values) const {
+        const double* bounds = node.facet == FACET_PRICE ? PRICE_BANDS.data() : RATING_BANDS.data();
+        size_t count = node.facet == FACET_PRICE ? PRICE_BANDS.size() : RATING_BANDS.size();
+        const NumericRange& range = node.range;
+        RoaringBitmap result;
+        for (size_t band : overlappingBands(node)) {
+            double low = band == 0 ? -HUGE_VAL : bounds[band - 1];
+            double high = band == count ? HUGE_VAL : bounds[band];
+            const RoaringBitmap& docs = facets[node.facet].docs[band];
+            bool inside = (range.minInclusive ? low >= range.min : low > range.min) && high <= range.max;
+            if (inside) {
+                result = RoaringBitmap::unite(result, docs);
+                continue;
+            }
+            vector<uint32_t> kept;
+            docs.forEach([&](uint32_t doc) {
+                if (range.contains(values[doc])) kept.push_back(doc);
+            });
+            result = RoaringBitmap::unite(result, RoaringBitmap::fromSorted(kept.data(), kept.size()));
+        }
+        return result;
+    }
+
+    // Fill in each node's estimated doc count and order every AND most
+    // selective first, exclusions last. Estimates are exact for facet values
+    // and terms, the rarest word's count for phrases, and band-level upper
+    // bounds for ranges.
+    void estimatePlan(QueryPlanNode& node) const {
+        size_t docCount = docKeys.size();
+        switch (node.kind) {
+            case QueryPlanNode::ALL:
+                node.estimate = docCount;
+                break;
+            case QueryPlanNode::FACET_VALUE: {
+                const RoaringBitmap* docs = facets[node.facet].find(node.value);
+                node.estimate = docs ? docs->cardinality() : 0;
+                break;
+            }
+            case QueryPlanNode::TERM: {
+                uint32_t termId = findTerm(node.value);
+                node.estimate = termId == NO_TERM ? 0 : termDocumentCount(termId);
+                break;
+            }
+            case QueryPlanNode::PHRASE:
+                node.estimate = docCount;
+                for (const string& word : surfaceWords(node.value)) {
+                    uint32_t termId = findTerm(word);
+                    node.estimate = min<size_t>(node.estimate, termId == NO_TERM ? 0 : termDocumentCount(termId));
+                }
+                break;
+            case QueryPlanNode::RANGE: {
+                node.estimate = 0;
+                for (size_t band : overlappingBands(node)) {
+                    node.estimate += facets[node.facet].docs[band].cardinality();
+                }
+                break;
+            }
+            case QueryPlanNode::OR:
+                node.estimate = 0;
+                for (QueryPlanNode& child : node.children) {
+                    estimatePlan(child);
+                    node.estimate = min(docCount, node.estimate + child.estimate);
+                }
+                break;
+            case QueryPlanNode::NOT:
+                estimatePlan(node.children[0]);
+                node.estimate = docCount - min(docCount, node.children[0].estimate);
+                break;
+            case QueryPlanNode::AND:
+                node.estimate = docCount;
+                for (QueryPlanNode& child : node.children) {
+                    estimatePlan(child);
+                    if (child.kind != QueryPlanNode::NOT) node.estimate = min(node.estimate, child.estimate);
+                }
+                stable_sort(node.children.begin(), node.children.end(), [](const auto& a, const auto& b) {
+                    bool aExcludes = a.kind == QueryPlanNode::NOT;
+                    bool bExcludes = b.kind == QueryPlanNode::NOT;
+                    if (aExcludes != bExcludes) return bExcludes;
+                    return a.estimate < b.estimate;
+                });
+                break;
+        }
+    }
+
+    // Bands of a RANGE node's facet that overlap its range
+    vector<size_t> overlappingBands(const QueryPlanNode& node) const {
+        const double* bounds = node.facet == FACET_PRICE ? PRICE_BANDS.data() : RATING_BANDS.data();
+        size_t count = node.facet == FACET_PRICE ? PRICE_BANDS.size() : RATING_BANDS.size();
+        const NumericRange& range = node.range;
+        vector<size_t> bands;
+        for (size_t band = 0; band <= count; band++) {
+            double low = band == 0 ? -HUGE_VAL : bounds[band - 1];
+            double high = band == count ? HUGE_VAL : bounds[band];
+            if (high <= range.min || low > range.max || (low == range.max && !range.maxInclusive)) continue;
+            bands.push_back(band);
+        }
+        return bands;
+    }
+
+    // Docs passing a plan node, restricted to within when given. An AND runs
+    // its children in plan order, each over the survivors of the ones before,
+    // and stops once nothing survives; a range over fewer survivors than its
+    // bands hold checks their values directly.
+    RoaringBitmap executePlan(const QueryPlanNode& node, const RoaringBitmap* within) const {
+        auto restrict = [within](const RoaringBitmap& docs) {
+            return within ? RoaringBitmap::intersect(*within, docs) : docs;
+        };
+        switch (node.kind) {
+            case QueryPlanNode::FACET_VALUE: {
+                const RoaringBitmap* docs = facets[node.facet].find(node.value);
+                return docs ? restrict(*docs) : RoaringBitmap();
+            }
+            case QueryPlanNode::TERM: {
+                uint32_t termId = findTerm(node.value);
+                if (termId == NO_TERM) return RoaringBitmap();
+                return restrict(RoaringBitmap::fromSorted(postingDocs.data() + termPostingOffsets[termId],
+                                                          termDocumentCount(termId)));
+            }
+            case QueryPlanNode::PHRASE: {
+                vector<uint32_t> docs = phraseDocs(surfaceWords(node.value), node.slop, within);
+                return RoaringBitmap::fromSorted(docs.data(), docs.size());
+            }
+            case QueryPlanNode::RANGE: {
+                const IndexArray<double>& values = node.facet == FACET_PRICE ? docPrices : docRatings;
+                if (within && within->cardinality() < node.estimate) {
+                    vector<uint32_t> kept;
+                    within->forEach([&](uint32_t doc) {
+                        if (node.range.contains(values[doc])) kept.push_back(doc);
+                    });
+                    return RoaringBitmap::fromSorted(kept.data(), kept.size());
+                }
+                return restrict(rangeDocs(node, values));
+            }
+            case QueryPlanNode::OR: {
+                RoaringBitmap any;
+                for (const QueryPlanNode& child : node.children) {
+                    any = RoaringBitmap::unite(any, executePlan(child, within));
+                }
+                return any;
+            }
+            case QueryPlanNode::NOT:
+                return RoaringBitmap::subtract(within ? *within : allDocs, executePlan(node.children[0], within));
+            case QueryPlanNode::AND: {
+                RoaringBitmap survivors = within ? *within : allDocs;
+                for (const QueryPlanNode& child : node.children) {
+                    if (survivors.empty()) break;
+                    survivors = executePlan(child, &survivors);
+                }
+                return survivors;
+            }
+            default:
+                return within ? *within : allDocs;
+        }
+    }
+
+    // Sidebar filters and query conjuncts as one estimated AND plan, leaving
+    // out the conjuncts on skipFacet (for disjunctive facet counts)
+    QueryPlanNode compilePlan(const vector<QueryPlanNode>& conjuncts, const FacetFilter& filter,
+                              int skipFacet = -1) const {
+        vector<QueryPlanNode> children;
+        for (const QueryPlanNode& node : filterConjuncts(filter)) {
+            if (skipFacet < 0 || node.facet != skipFacet) children.push_back(node);
+        }
+        for (const QueryPlanNode& node : conjuncts) {
+            if (skipFacet < 0 || node.facet != skipFacet) children.push_back(node);
+        }
+        QueryPlanNode plan = QueryPlanNode::combine(QueryPlanNode::AND, move(children));
+        estimatePlan(plan);
+        return plan;
+    }
+
+    // Per-value counts over the matches. Each facet is counted under every
+    // other facet's filter but not its own, so the sidebar keeps offering
+    // alternatives to a selected value. Brands and categories come most
+    // frequent first; bands stay in band order.
+    FacetCounts countFacets(const RoaringBitmap& matches, const vector<QueryPlanNode>& conjuncts,
+                            const FacetFilter& filter) const {
+        FacetCounts counts;
+        for (int facet = 0; facet < FACET_COUNT; facet++) {
+            QueryPlanNode plan = compilePlan(conjuncts, filter, facet);
+            RoaringBitmap base = plan.children.empty() ? matches : executePlan(plan, &matches);
+            const FacetIndex& index = facets[facet];
+            for (uint32_t value = 0; value < index.values.size(); value++) {
+                size_t count = RoaringBitmap::intersectCount(base, index.docs[value]);
+                if (count) counts[facet].push_back({string(index.values.text(value)), count});
+            }
+            if (facet == FACET_BRAND || facet == FACET_CATEGORY) {
+                stable_sort(counts[facet].begin(), counts[facet].end(),
+                            [](const auto& a, const auto& b) { return a.second > b.second; });
+            }
+        }
+        return counts;
+    }
+
+    void buildCategoryIndex() {
+        categoryOffsets.assign(1, 0);
+        categoryDocs.clear();
+        for (auto& docs : buildCategories) {
+            vector<pair<double, int>> ranked;  // (score, key) as searchByCategory always ranked
+            for (uint32_t doc : docs) {
+                ranked.push_back({docRatings[doc] * 10, static_cast<int>(doc)});
+            }
+            sort(ranked.begin(), ranked.end(), [this](const auto& a, const auto& b) {
+                if (a.first != b.first) return a.first > b.first;
+                return docKeys[a.second] > docKeys[b.second];
+            });
+            for (const auto& entry : ranked) categoryDocs.push_back(static_cast<uint32_t>(entry.second));
+            categoryOffsets.push_back(static_cast<uint32_t>(categoryDocs.size()));
+        }
+        vector<string> names(categoryIds.size());
+        for (const auto& [name, id] : categoryIds) names[id] = name;
+        categoryNames.build(names);
+
+        unordered_map<string, uint32_t>().swap(categoryIds);
+        vector<vector<uint32_t>>().swap(buildCategories);
+        categoryDocs.shrink_to_fit();
+    }
+
+    static uint32_t packTrigram(const string& text, size_t i) {
+        return (uint32_t(static_cast<unsigned char>(text[i])) << 16) |
+               (uint32_t(static_cast<unsigned char>(text[i + 1])) << 8) |
+               uint32_t(static_cast<unsigned char>(text[i + 2]));
+    }
+
+    // Distinct trigrams of each field; trigrams never span two fields
+    static vector<uint32_t> distinctTrigrams(const vector<string>& texts) {
+        vector<uint32_t> trigrams;
+        for (const string& text : texts) {
+            for (size_t i = 0; i + 3 <= text.size(); i++) {
+                trigrams.push_back(packTrigram(text, i));
+            }
+        }
+        sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        return trigrams;
+    }
+
+    // Append the product's lowercased fields to the text blob and index
+    // their trigrams
+    void indexText(uint32_t doc, const Product& product) {
+        vector<string> fields = {toLowerCase(product.name), toLowerCase(product.brand),
+                                 toLowerCase(product.category)};
+        for (const string& field : fields) {
+            textBlob.insert(textBlob.end(), field.begin(), field.end());
+            textBlob.push_back(FIELD_SEPARATOR);
+        }
+        textOffsets.push_back(static_cast<uint32_t>(textBlob.size()));
+
+        auto [category, added] = categoryIds.emplace(fields[2], static_cast<uint32_t>(buildCategories.size()));
+        if (added) buildCategories.emplace_back();
+        buildCategories[category->second].push_back(doc);
+
+        for (uint32_t trigram : distinctTrigrams(fields)) {
+            buildTrigrams[trigram].push_back(doc);
+        }
+    }
+
+    // Every doc whose name, brand or category contains the query, in one
+    // SIMD pass over the blob; after a hit the scan resumes at the next doc.
+    // The blob is searched SCAN_CHUNK bytes at a time so the deadline is
+    // checked between chunks; returns false if it stopped the scan early.
+    bool scanTextBlob(const string& lowerQuery, vector<uint32_t>& docs, const Deadline& deadline = {}) const {
+        uint32_t docCount = static_cast<uint32_t>(docKeys.size());
+        if (lowerQuery.empty()) {
+            for (uint32_t doc = 0; doc < docCount; doc++) docs.push_back(doc);
+            return true;
+        }
+
+        const char* base = textBlob.data();
+        const char* end = base + textBlob.size();
+        const char* cursor = base;
+        uint32_t doc = 0;
+        size_t overlap = lowerQuery.size() - 1;  // a hit may straddle two chunks
+        while (static_cast<size_t>(end - cursor) > overlap) {
+            if (deadline.passed()) return false;
+            const char* chunkEnd = static_cast<size_t>(end - cursor) > SCAN_CHUNK + overlap
+                ? cursor + SCAN_CHUNK + overlap : end;
+            const char* hit;
+            while ((hit = findSubstring(cursor, chunkEnd, lowerQuery.data(), lowerQuery.size())) != chunkEnd) {
+                uint32_t position = static_cast<uint32_t>(hit - base);
+                doc = static_cast<uint32_t>(
+                    upper_bound(textOffsets.begin() + doc + 1, textOffsets.end(), position) -
+                    textOffsets.begin() - 1);
+                docs.push_back(doc);
+                cursor = base + textOffsets[doc + 1];
+                if (cursor >= chunkEnd) break;
+                if (deadline.passedAt(docs.size())) return false;
+            }
+            if (hit == chunkEnd) cursor = chunkEnd - overlap;
+        }
+        return true;
+    }
+
+    void buildTrigramIndex() {
+        trigramKeys.clear();
+        for (const auto& [trigram, docs] : buildTrigrams) trigramKeys.push_back(trigram);
+        sort(trigramKeys.begin(), trigramKeys.end());
+
+        trigramOffsets.assign(1, 0);
+        trigramDocs.clear();
+        for (uint32_t trigram : trigramKeys) {
+            const auto& docs = buildTrigrams[trigram];
+            trigramDocs.insert(trigramDocs.end(), docs.begin(), docs.end());
+            trigramOffsets.push_back(static_cast<uint32_t>(trigramDocs.size()));
+        }
+
+        unordered_map<uint32_t, vector<uint32_t>>().swap(buildTrigrams);
+        trigramKeys.shrink_to_fit();
+        trigramDocs.shrink_to_fit();
+    }
+
+    // Docs containing every trigram of the query, rarest list first. These
+    // still need verification: the trigrams may sit apart or in other fields.
+    vector<uint32_t> trigramCandidates(const string& lowerQuery) const {
+        vector<pair<uint32_t, uint32_t>> lists;  // (begin, end) in trigramDocs
+        for (uint32_t trigram : distinctTrigrams({lowerQuery})) {
+            auto it = lower_bound(trigramKeys.begin(), trigramKeys.end(), trigram);
+            if (it == trigramKeys.end() || *it != trigram) return {};
+            size_t index = it - trigramKeys.begin();
+            lists.push_back({trigramOffsets[index], trigramOffsets[index + 1]});
+        }
+        if (lists.empty()) return {};
+        sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) {
+            return a.second - a.first < b.second - b.first;
+        });
+
+        vector<uint32_t> candidates(trigramDocs.begin() + lists[0].first,
+                                    trigramDocs.begin() + lists[0].second);
+        for (size_t l = 1; l < lists.size() && !candidates.empty(); l++) {
+            auto from = trigramDocs.begin() + lists[l].first;
+            auto to = trigramDocs.begin() + lists[l].second;
+            size_t kept = 0;
+            for (uint32_t doc : candidates) {
+                from = lower_bound(from, to, doc);
+                if (from == to) break;
+                if (*from == doc) candidates[kept++] = doc;
+            }
+            candidates.resize(kept);
+        }
+        return candidates;
+    }
+
+    // Count each field's terms for one product and record their positions.
+    // Description words follow the trie's rule (longer than 3 characters as
+    // typed, whatever their stem) but every term counts toward length and
+    // takes up a position, so phrases never match across a skipped one. Stop
+    // words take up neither.
+    void indexFields(uint32_t doc, const Product& product) {
+        const string* fields[FIELD_COUNT] = {&product.name, &product.brand,
+                                             &product.category, &product.description};
+        array<uint16_t, FIELD_COUNT> lengths{};
+        struct WordCounts {
+            array<uint16_t, FIELD_COUNT> tf{};
+            vector<uint32_t> positions;
+            string surface;  // shortest spelling in this product
+        };
+        unordered_map<string, WordCounts> counts;
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            size_t index = 0;
+            for (const string& word : surfaceWords(*fields[field])) {
+                string term = indexTerm(word);
+                if (term.empty()) continue;
+                size_t position = index++;
+                if (field == FIELD_DESCRIPTION && word.length() <= 3) continue;
+                WordCounts& entry = counts[term];
+                if (entry.tf[field] < UINT16_MAX) entry.tf[field]++;
+                if (position <= MAX_FIELD_POSITION) {
+                    entry.positions.push_back(static_cast<uint32_t>(field) << POSITION_FIELD_SHIFT |
+                                              static_cast<uint32_t>(position));
+                }
+                if (entry.surface.empty() || shorterSpelling(word, entry.surface)) entry.surface = word;
+            }
+            lengths[field] = static_cast<uint16_t>(min<size_t>(index, UINT16_MAX));
+        }
+        fieldLengths.push_back(lengths);
+
+        for (const auto& [word, entry] : counts) {
+            noteSurface(word, entry.surface);
+            auto [it, added] = termIds.emplace(word, static_cast<uint32_t>(buildPostings.size()));
+            if (added) {
+                buildPostings.emplace_back();
+                buildPositions.emplace_back();
+            }
+            buildPostings[it->second].push_back({doc, entry.tf, static_cast<uint32_t>(entry.positions.size())});
+            buildPositions[it->second].insert(buildPositions[it->second].end(), entry.positions.begin(),
+                                              entry.positions.end());
+        }
+    }
+
+    // Spellings shown for a term: the shortest one indexed, ties going to
+    // the first alphabetically, so the choice does not depend on the order
+    // products were indexed or shards merged in
+    static bool shorterSpelling(const string& a, const string& b) {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    }
+
+    void noteSurface(const string& term, const string& surface) {
+        auto [it, added] = termSurfaces.emplace(term, surface);
+        if (!added && shorterSpelling(surface, it->second)) it->second = surface;
+    }
+
+    // The spelling shown for an indexed string: a term's surface form, or
+    // the string itself
+    const string& displayText(const string& text) const {
+        auto it = termSurfaces.find(text);
+        return it == termSurfaces.end() ? text : it->second;
+    }
+
+    // Precompute each posting's BM25F impact and attach term ids to the trie.
+    // With a collection, its docs other than the masked ones count toward
+    // document frequencies and its average field lengths are used as they are.
+    void buildInvertedIndex(const EnhancedTrie* collection, const vector<uint32_t>* collectionMasked) {
+        static const vector<uint32_t> noDocs;
+        const vector<uint32_t>& masked = collectionMasked ? *collectionMasked : noDocs;
+        double docCount = static_cast<double>(docKeys.size());
+        fieldLengthAverages.assign(FIELD_COUNT, 0.0);
+        for (const auto& lengths : fieldLengths) {
+            for (int field = 0; field < FIELD_COUNT; field++) fieldLengthAverages[field] += lengths[field];
+        }
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            fieldLengthAverages[field] = docCount > 0 ? max(1.0, fieldLengthAverages[field] / docCount) : 1.0;
+            if (collection) fieldLengthAverages[field] = collection->fieldLengthAverages[field];
+        }
+        const double* avgLength = fieldLengthAverages.data();
+        if (collection) docCount += collection->productCount() - masked.size();
+
+        vector<const string*> termsById(termIds.size());
+        for (const auto& [term, termId] : termIds) termsById[termId] = &term;
+
+        termPostingOffsets.assign(1, 0);
+        postingDocs.clear();
+        postingImpacts.clear();
+        postingPositionOffsets.assign(1, 0);
+        positions.clear();
+        uint32_t positionEnd = 0;
+        for (uint32_t termId = 0; termId < buildPostings.size(); termId++) {
+            const auto& occurrences = buildPostings[termId];
+            positions.insert(positions.end(), buildPositions[termId].begin(), buildPositions[termId].end());
+            double df = static_cast<double>(occurrences.size());
+            if (collection) {
+                uint32_t known = collection->findTerm(*termsById[termId]);
+                if (known != NO_TERM) df += collection->termDocumentCount(known, masked);
+            }
+            double idf = log(1.0 + (docCount - df + 0.5) / (df + 0.5));
+            for (const TermOccurrence& occurrence : occurrences) {
+                double tf = 0.0;
+                for (int field = 0; field < FIELD_COUNT; field++) {
+                    if (!occurrence.tf[field]) continue;
+                    double norm = 1.0 - FIELD_B[field] +
+                        FIELD_B[field] * fieldLengths[occurrence.doc][field] / avgLength[field];
+                    tf += FIELD_BOOST[field] * occurrence.tf[field] / norm;
+                }
+                postingDocs.push_back(occurrence.doc);
+                postingImpacts.push_back(static_cast<float>(idf * tf / (BM25_K1 + tf)));
+                positionEnd += occurrence.positionCount;
+                postingPositionOffsets.push_back(positionEnd);
+            }
+            termPostingOffsets.push_back(static_cast<uint32_t>(postingDocs.size()));
+        }
+        buildPostingBlocks();
+
+        for (const auto& [term, termId] : termIds) {
+            bool endsOnNode = false;
+            uint32_t node = findPrefixNode(term, &endsOnNode);
+            if (node != NO_NODE && endsOnNode && nodes[node].isEndOfWord) {
+                nodes[node].termId = termId;
+            }
+        }
+        vector<const string*> spellings;
+        for (const string* term : termsById) spellings.push_back(&displayText(*term));
+        buildSpellingIndex(spellings);
+
+        unordered_map<string, uint32_t>().swap(termIds);
+        vector<vector<TermOccurrence>>().swap(buildPostings);
+        vector<vector<uint32_t>>().swap(buildPositions);
+        vector<array<uint16_t, FIELD_COUNT>>().swap(fieldLengths);
+        postingDocs.shrink_to_fit();
+        postingImpacts.shrink_to_fit();
+        postingPositionOffsets.shrink_to_fit();
+        positions.shrink_to_fit();
+    }
+
+    void buildPostingBlocks() {
+        termBlockOffsets.assign(1, 0);
+        blockLastDocs.clear();
+        blockMaxImpacts.clear();
+        termMaxImpacts.clear();
+        for (size_t termId = 0; termId + 1 < termPostingOffsets.size(); termId++) {
+            uint32_t begin = termPostingOffsets[termId];
+            size_t firstBlock = blockMaxImpacts.size();
+            appendPostingBlocks(postingDocs.data() + begin, postingImpacts.data() + begin,
+                                termPostingOffsets[termId + 1] - begin, blockLastDocs, blockMaxImpacts);
+            termBlockOffsets.push_back(static_cast<uint32_t>(blockMaxImpacts.size()));
+            termMaxImpacts.push_back(firstBlock == blockMaxImpacts.size() ? 0.0f :
+                *max_element(blockMaxImpacts.begin() + firstBlock, blockMaxImpacts.end()));
+        }
+
+        maxRatingBoost = docRatings.empty() ? 0.0 : -HUGE_VAL;
+        for (double rating : docRatings) maxRatingBoost = max(maxRatingBoost, rating * RATING_WEIGHT);
+    }
+
+    // Store each term's spelling and every delete of its prefix
+    void buildSpellingIndex(const vector<const string*>& termsById) {
+        termChars.clear();
+        termTextOffsets.assign(1, 0);
+        deleteIndex.clear();
+
+        vector<string> deletes;
+        for (uint32_t termId = 0; termId < termsById.size(); termId++) {
+            const string& term = *termsById[termId];
+            termChars.insert(termChars.end(), term.begin(), term.end());
+            termTextOffsets.push_back(static_cast<uint32_t>(termChars.size()));
+
+            deletes.clear();
+            collectDeletes(term.substr(0, SPELLING_PREFIX_LENGTH), MAX_SPELLING_EDITS, deletes);
+            for (const string& variant : deletes) {
+                deleteIndex.push_back({hashString(variant), termId});
+            }
+        }
+
+        sort(deleteIndex.begin(), deleteIndex.end());
+        deleteIndex.erase(unique(deleteIndex.begin(), deleteIndex.end()), deleteIndex.end());
+        termChars.shrink_to_fit();
+        deleteIndex.shrink_to_fit();
+    }
+
+    // The string itself plus every string reachable by up to maxDeletes deletions
+    static void collectDeletes(const string& word, int maxDeletes, vector<string>& out) {
+        size_t first = out.size();
+        out.push_back(word);
+        for (size_t i = first; i < out.size(); i++) {
+            const string current = out[i];
+            if (static_cast<int>(word.size() - current.size()) >= maxDeletes) continue;
+            for (size_t j = 0; j < current.size(); j++) {
+                string shorter = current.substr(0, j) + current.substr(j + 1);
+                if (find(out.begin() + first, out.end(), shorter) == out.end()) {
+                    out.push_back(shorter);
+                }
+            }
+        }
+    }
+
+    string termText(uint32_t termId) const {
+        return string(termChars.begin() + termTextOffsets[termId],
+                      termChars.begin() + termTextOffsets[termId + 1]);
+    }
+
+    uint32_t termDocumentCount(uint32_t termId) const {
+        return termPostingOffsets[termId + 1] - termPostingOffsets[termId];
+    }
+
+    // Docs holding a term, less those in excluded (sorted). A few excluded
+    // docs are looked up in the postings; many are merged against them.
+    uint32_t termDocumentCount(uint32_t termId, const vector<uint32_t>& excluded) const {
+        const uint32_t* begin = postingDocs.data() + termPostingOffsets[termId];
+        const uint32_t* end = postingDocs.data() + termPostingOffsets[termId + 1];
+        uint32_t count = static_cast<uint32_t>(end - begin);
+        if (excluded.size() * POSTING_BLOCK_SIZE < count) {
+            for (uint32_t doc : excluded) count -= binary_search(begin, end, doc);
+        } else {
+            auto doc = excluded.begin();
+            for (const uint32_t* posting = begin; posting != end && doc != excluded.end();) {
+                if (*posting < *doc) {
+                    posting++;
+                } else if (*doc < *posting) {
+                    doc++;
+                } else {
+                    count--;
+                    posting++;
+                    doc++;
+                }
+            }
+        }
+        return count;
+    }
+
+    // Term id of an exact dictionary word, or NO_TERM
+    uint32_t findTerm(const string& word) const {
+        bool endsOnNode = false;
+        uint32_t node = findPrefixNode(word, &endsOnNode);
+        if (node == NO_NODE || !endsOnNode || word.empty()) return NO_TERM;
+        return nodes[node].termId;
+    }
+
+    // Dictionary terms within the word's edit budget, best first. Candidates
+    // come from hash lookups of the word's own deletes and are then verified
+    // against the full word with the Myers kernel.
+    vector<string> spellingCandidates(const string& word, size_t limit) const {
+        int maxEdits = min(maxEditsFor(word.length()), MAX_SPELLING_EDITS);
+        if (maxEdits == 0 || deleteIndex.empty()) return {};
+
+        vector<string> deletes;
+        collectDeletes(word.substr(0, SPELLING_PREFIX_LENGTH), maxEdits, deletes);
+
+        MyersMatcher matcher(word);
+        vector<uint32_t> seen;
+        vector<tuple<int, uint32_t, uint32_t>> ranked;  // (edits, -documents, term id)
+        for (const string& variant : deletes) {
+            uint64_t hash = hashString(variant);
+            auto range = equal_range(deleteIndex.begin(), deleteIndex.end(), DeleteEntry{hash, 0},
+                                     [](const DeleteEntry& a, const DeleteEntry& b) { return a.hash < b.hash; });
+            for (auto it = range.first; it != range.second; ++it) {
+                uint32_t termId = it->termId;
+                if (find(seen.begin(), seen.end(), termId) != seen.end()) continue;
+                seen.push_back(termId);
+
+                int edits = matcher.distance(termText(termId), maxEdits);
+                if (edits <= maxEdits) {
+                    ranked.push_back({edits, UINT32_MAX - termDocumentCount(termId), termId});
+                }
+            }
+        }
+
+        sort(ranked.begin(), ranked.end());
+        vector<string> candidates;
+        for (size_t i = 0; i < ranked.size() && i < limit; i++) {
+            candidates.push_back(termText(get<2>(ranked[i])));
+        }
+        return candidates;
+    }
+
+    static string joinWords(const vector<string>& words) {
+        string joined;
+        for (const string& word : words) {
+            if (!joined.empty()) joined += ' ';
+            joined += word;
+        }
+        return joined;
+    }
+
+    // Terms a query word should score: the exact term at full weight, then the
+    // nearest completions breadth-first, bounded so short prefixes stay cheap
+    vector<pair<uint32_t, double>> expandTerm(const string& word) const {
+        vector<pair<uint32_t, double>> terms;
+        bool endsOnNode = false;
+        uint32_t start = findPrefixNode(word, &endsOnNode);
+        if (start == NO_NODE) return terms;
+
+        vector<uint32_t> queue = {start};
+        for (size_t i = 0; i < queue.size() && i < MAX_EXPANSION_VISITS; i++) {
+            const FlatTrieNode& node = nodes[queue[i]];
+            if (node.termId != UINT32_MAX) {
+                bool exact = i == 0 && endsOnNode;
+                terms.push_back({node.termId, exact ? 1.0 : PREFIX_EXPANSION_WEIGHT});
+                if (terms.size() > MAX_EXPANSIONS) break;
+            }
+            for (uint32_t child = 0; child < node.childCount; child++) {
+                queue.push_back(node.firstChild + child);
+            }
+        }
+        return terms;
+    }
+
+    // Scored list over a term's postings in the inverted index
+    ScoredList termList(uint32_t termId, double weight) const {
+        ScoredList list;
+        uint32_t begin = termPostingOffsets[termId];
+        list.docs = postingDocs.data() + begin;
+        list.impacts = postingImpacts.data() + begin;
+        list.size = termPostingOffsets[termId + 1] - begin;
+        list.blockLastDocs = blockLastDocs.data() + termBlockOffsets[termId];
+        list.blockMaxImpacts = blockMaxImpacts.data() + termBlockOffsets[termId];
+        list.maxImpact = termMaxImpacts[termId];
+        list.weight = weight;
+        return list;
+    }
+
+    // Docs holding the words in order within one field, with at most slop
+    // other words between them in total, restricted to within when given.
+    // The rarest word's postings (or within, when smaller) supply the
+    // candidates; every word's cursor skips to each one through its block
+    // summaries, so positions are read only for docs all the words share.
+    // Gives up, returning nothing, when even the rarest word is in more than
+    // maxLeadDocs docs.
+    vector<uint32_t> phraseDocs(const vector<string>& words, uint32_t slop, const RoaringBitmap* within,
+                                size_t maxLeadDocs = SIZE_MAX) const {
+        vector<ScoredList> lists;
+        for (const string& word : words) {
+            uint32_t termId = findTerm(word);
+            if (termId == NO_TERM) return {};
+            lists.push_back(termList(termId, 1.0));
+        }
+        vector<ListCursor> cursors;
+        size_t lead = 0;
+        for (size_t w = 0; w < lists.size(); w++) {
+            cursors.push_back(ListCursor{&lists[w]});
+            if (lists[w].size < lists[lead].size) lead = w;
+        }
+        if (lists[lead].size > maxLeadDocs) return {};
+
+        vector<uint32_t> withinDocs;
+        const uint32_t* candidates = lists[lead].docs;
+        size_t candidateCount = lists[lead].size;
+        bool leadDrives = true;
+        if (within && within->cardinality() < candidateCount) {
+            withinDocs = within->toVector();
+            candidates = withinDocs.data();
+            candidateCount = withinDocs.size();
+            within = nullptr;
+            leadDrives = false;
+        }
+
+        vector<uint32_t> docs;
+        vector<pair<const uint32_t*, const uint32_t*>> spans(words.size());
+        for (size_t i = 0; i < candidateCount; i++) {
+            uint32_t doc = candidates[i];
+            if (within && !within->contains(doc)) continue;
+            bool shared = true;
+            for (size_t w = 0; w < cursors.size() && shared; w++) {
+                if (leadDrives && w == lead) {
+                    cursors[w].position = static_cast<uint32_t>(i);
+                    continue;
+                }
+                cursors[w].advanceTo(doc);
+                if (cursors[w].doc() == END_OF_LIST) return docs;
+                shared = cursors[w].doc() == doc;
+            }
+            if (!shared) continue;
+            for (size_t w = 0; w < cursors.size(); w++) {
+                size_t posting = lists[w].docs + cursors[w].position - postingDocs.data();
+                spans[w] = {positions.data() + postingPositionOffsets[posting],
+                            positions.data() + postingPositionOffsets[posting + 1]};
+            }
+            if (phraseAt(spans, slop)) docs.push_back(doc);
+        }
+        return docs;
+    }
+
+    // Whether one position per word, in word order and within one field,
+    // skips at most slop positions in total. Taking each word's nearest
+    // position after the previous word's leaves the least skipped, so one
+    // pass per start position settles it.
+    static bool phraseAt(const vector<pair<const uint32_t*, const uint32_t*>>& spans, uint32_t slop) {
+        for (const uint32_t* start = spans[0].first; start != spans[0].second; start++) {
+            uint32_t previous = *start;
+            uint32_t skipped = 0;
+            bool matched = true;
+            for (size_t w = 1; w < spans.size() && matched; w++) {
+                const uint32_t* next = upper_bound(spans[w].first, spans[w].second, previous);
+                if (next == spans[w].second) return false;
+                skipped += *next - previous - 1;
+                matched = (*next >> POSITION_FIELD_SHIFT) == (previous >> POSITION_FIELD_SHIFT) && skipped <= slop;
+                previous = *next;
+            }
+            if (matched) return true;
+        }
+        return false;
+    }
+
+    // The postings of a list whose docs are among the (sorted) survivors,
+    // found by probing forward through the list once per survivor
+    static ScoredList restrictList(const ScoredList& list, const vector<uint32_t>& survivors) {
+        vector<uint32_t> docs;
+        vector<float> impacts;
+        const uint32_t* cursor = list.docs;
+        const uint32_t* end = list.docs + list.size;
+        for (uint32_t doc : survivors) {
+            cursor = lower_bound(cursor, end, doc);
+            if (cursor == end) break;
+            if (*cursor == doc) {
+                docs.push_back(doc);
+                impacts.push_back(list.impacts[cursor - list.docs]);
+            }
+        }
+        ScoredList restricted = ownedList(move(docs), move(impacts));
+        restricted.weight = list.weight;
+        return restricted;
+    }
+
+    // Scored list over per-query hits, given in doc order
+    static ScoredList ownedList(vector<uint32_t> docs, vector<float> impacts) {
+        ScoredList list;
+        list.ownedDocs = move(docs);
+        list.ownedImpacts = move(impacts);
+        appendPostingBlocks(list.ownedDocs.data(), list.ownedImpacts.data(), list.ownedDocs.size(),
+                            list.ownedBlockLastDocs, list.ownedBlockMaxImpacts);
+        list.docs = list.ownedDocs.data();
+        list.impacts = list.ownedImpacts.data();
+        list.blockLastDocs = list.ownedBlockLastDocs.data();
+        list.blockMaxImpacts = list.ownedBlockMaxImpacts.data();
+        list.size = static_cast<uint32_t>(list.ownedDocs.size());
+        for (float impact : list.ownedBlockMaxImpacts) list.maxImpact = max(list.maxImpact, impact);
+        return list;
+    }
+
+    // Term-at-a-time: add every posting into the dense accumulator, then
+    // partially sort the touched docs. Leaves the top maxResults in scratch.ranked.
+    void rankExhaustive(const vector<ScoredList>& lists, size_t maxResults, const RoaringBitmap* allowedDocs,
+                        const ResultCursor& after, SearchScratch& scratch, SearchStats& stats) const {
+        ScoreAccumulator& relevance = scratch.relevance;  // doc -> relevance score
+        relevance.reset(docKeys.size());
+        for (const ScoredList& list : lists) {
+            for (uint32_t i = 0; i < list.size; i++) {
+                relevance.add(list.docs[i], list.weight * list.impacts[i]);
+            }
+            stats.postingsScored += list.size;
+        }
+
+        vector<pair<double, int>>& scoredResults = scratch.ranked;
+        scoredResults.clear();
+        for (uint32_t doc : relevance.touchedDocs()) {
+            if (allowedDocs && !allowedDocs->contains(doc)) continue;
+            double finalScore = relevance.score(doc) + docRatings[doc] * RATING_WEIGHT;
+            if (after.admits({finalScore, docKeys[doc]})) scoredResults.push_back({finalScore, docKeys[doc]});
+        }
+        stats.docsScored = scoredResults.size();
+        size_t keep = min(maxResults, scoredResults.size());
+        partial_sort(scoredResults.begin(), scoredResults.begin() + keep, scoredResults.end(),
+                     greater<pair<double, int>>());  // score, then key, descending
+        scoredResults.resize(keep);
+    }
+
+    // Document-at-a-time top-K with WAND. Cursors are kept sorted by doc; the
+    // pivot is the first doc whose lists' score bounds, plus the largest
+    // rating boost, could reach the current K-th score, and docs before it
+    // are skipped. Block-max WAND then checks the maxima of the blocks that
+    // would hold the pivot and, when even those fall short, jumps past the
+    // blocks. Docs are summed in list order, so scores match rankExhaustive
+    // exactly, and ties stay in since the K-th entry can lose on key. Docs
+    // ranked before the cursor are scored but never enter the top-K, so they
+    // do not raise the threshold. Past the deadline the walk stops and keeps
+    // the best docs it reached.
+    void rankWand(const vector<ScoredList>& lists, size_t maxResults, bool useBlockMax,
+                  const RoaringBitmap* allowedDocs, const ResultCursor& after, vector<pair<double, int>>& top,
+                  SearchStats& stats, const Deadline& deadline = {}) const {
+        top.clear();
+        if (maxResults == 0) return;
+
+        vector<ListCursor> cursors;
+        for (const ScoredList& list : lists) {
+            if (list.size) cursors.push_back(ListCursor{&list});
+        }
+        vector<ListCursor*> order;
+        for (ListCursor& cursor : cursors) order.push_back(&cursor);
+        auto byDoc = [](const ListCursor* a, const ListCursor* b) { return a->doc() < b->doc(); };
+        auto heapOrder = greater<pair<double, int>>();  // min-heap on (score, key)
+        sort(order.begin(), order.end(), byDoc);
+
+        for (size_t step = 1;; step++) {
+            if (deadline.passedAt(step)) {
+                stats.degraded = true;  // top holds the best of the docs reached
+                break;
+            }
+            double threshold = top.size() < maxResults ? -HUGE_VAL : top.front().first - SCORE_EPSILON;
+
+            double bound = maxRatingBoost;
+            size_t pivot = order.size();
+            for (size_t i = 0; i < order.size() && order[i]->doc() != END_OF_LIST; i++) {
+                bound += order[i]->maxScore();
+                if (bound >= threshold) {
+                    pivot = i;
+                    break;
+                }
+            }
+            if (pivot == order.size()) break;
+            uint32_t pivotDoc = order[pivot]->doc();
+            while (pivot + 1 < order.size() && order[pivot + 1]->doc() == pivotDoc) pivot++;
+
+            if (useBlockMax) {
+                uint32_t next = pivot + 1 < order.size() ? order[pivot + 1]->doc() : END_OF_LIST;
+                double blockBound = maxRatingBoost;
+                for (size_t i = 0; i <= pivot; i++) {
+                    uint32_t blockLastDoc;
+                    blockBound += order[i]->blockMaxScore(pivotDoc, blockLastDoc);
+                    next = min(next, blockLastDoc + 1);
+                }
+                if (blockBound < threshold) {
+                    stats.blocksSkipped++;
+                    for (size_t i = 0; i <= pivot; i++) {
+                        if (order[i]->doc() < next) order[i]->advanceTo(next);
+                    }
+                    restoreDocOrder(order, pivot + 1);
+                    continue;
+                }
+            }
+
+            if (order[0]->doc() != pivotDoc) {
+                for (size_t i = 0; i < pivot && order[i]->doc() < pivotDoc; i++) {
+                    order[i]->advanceTo(pivotDoc);
+                }
+                restoreDocOrder(order, pivot);
+                continue;
+            }
+
+            // Every cursor up to the pivot sits on pivotDoc. Filtered-out docs
+            // are stepped over; the rest add up in list order (cursors are
+            // stored in list order, so by address).
+            if (allowedDocs && !allowedDocs->contains(pivotDoc)) {
+                for (size_t i = 0; i <= pivot; i++) order[i]->position++;
+                restoreDocOrder(order, pivot + 1);
+                continue;
+            }
+            sort(order.begin(), order.begin() + pivot + 1);
+            double relevance = 0.0;
+            for (size_t i = 0; i <= pivot; i++) {
+                relevance += order[i]->score();
+                order[i]->position++;
+            }
+            stats.postingsScored += pivot + 1;
+            stats.docsScored++;
+            restoreDocOrder(order, pivot + 1);
+            pair<double, int> entry = {relevance + docRatings[pivotDoc] * RATING_WEIGHT, docKeys[pivotDoc]};
+            if (!after.admits(entry)) continue;
+            if (top.size() < maxResults) {
+                top.push_back(entry);
+                push_heap(top.begin(), top.end(), heapOrder);
+            } else if (entry > top.front()) {
+                pop_heap(top.begin(), top.end(), heapOrder);
+                top.back() = entry;
+                push_heap(top.begin(), top.end(), heapOrder);
+            }
+        }
+        sort_heap(top.begin(), top.end(), heapOrder);  // score, then key, descending
+    }
+
+    // Re-sort cursors by doc after the first moved ones advanced; the rest
+    // are still in order, so each moved cursor is inserted into place
+    static void restoreDocOrder(vector<ListCursor*>& order, size_t moved) {
+        for (size_t i = moved; i-- > 0;) {
+            ListCursor* cursor = order[i];
+            uint32_t doc = cursor->doc();
+            size_t j = i;
+            while (j + 1 < order.size() && order[j + 1]->doc() < doc) {
+                order[j] = order[j + 1];
+                j++;
+            }
+            order[j] = cursor;
+        }
+    }
+
+    // Independent parts of a shard merge, run as separate tasks
+    enum MergePart { MERGE_TRIE, MERGE_POSTINGS, MERGE_TEXT, MERGE_FACETS, MERGE_PARTS };
+
+    // Append one part of a shard's build state, whose docs follow this
+    // trie's first docOffset docs, and release it from the shard. Parts
+    // touch disjoint members, so the parts of a merge run concurrently.
+    void absorb(EnhancedTrie& shard, uint32_t docOffset, size_t part) {
+        if (part == MERGE_TRIE) {
+            vector<pair<uint32_t, uint32_t>> pending = {{0, 0}};  // (shard node, node here)
+            while (!pending.empty()) {
+                auto [from, into] = pending.back();
+                pending.pop_back();
+                const TrieNode& source = shard.buildNodes[from];
+                if (source.isEndOfWord) buildNodes[into].isEndOfWord = true;
+                for (const auto& [popularity, doc] : source.products) {
+                    buildNodes[into].products.push_back({popularity, doc + static_cast<int>(docOffset)});
+                }
+                for (uint32_t child = source.firstChild; child; child = shard.buildNodes[child].nextSibling) {
+                    pending.push_back({child, findOrAddChild(into, shard.buildNodes[child].label)});
+                }
+            }
+            vector<TrieNode>().swap(shard.buildNodes);
+        } else if (part == MERGE_POSTINGS) {
+            vector<const string*> terms(shard.termIds.size());
+            for (const auto& [term, termId] : shard.termIds) terms[termId] = &term;
+            for (uint32_t termId = 0; termId < terms.size(); termId++) {
+                auto [it, added] = termIds.emplace(*terms[termId], static_cast<uint32_t>(buildPostings.size()));
+                if (added) {
+                    buildPostings.emplace_back();
+                    buildPositions.emplace_back();
+                }
+                for (TermOccurrence occurrence : shard.buildPostings[termId]) {
+                    occurrence.doc += docOffset;
+                    buildPostings[it->second].push_back(occurrence);
+                }
+                const vector<uint32_t>& shardPositions = shard.buildPositions[termId];
+                buildPositions[it->second].insert(buildPositions[it->second].end(), shardPositions.begin(),
+                                                  shardPositions.end());
+            }
+            for (const auto& [term, surface] : shard.termSurfaces) noteSurface(term, surface);
+            unordered_map<string, string>().swap(shard.termSurfaces);
+            fieldLengths.insert(fieldLengths.end(), shard.fieldLengths.begin(), shard.fieldLengths.end());
+            unordered_map<string, uint32_t>().swap(shard.termIds);
+            vector<vector<TermOccurrence>>().swap(shard.buildPostings);
+            vector<vector<uint32_t>>().swap(shard.buildPositions);
+        } else if (part == MERGE_TEXT) {
+            uint32_t blobOffset = static_cast<uint32_t>(textBlob.size());
+            textBlob.insert(textBlob.end(), shard.textBlob.begin(), shard.textBlob.end());
+            for (size_t doc = 1; doc < shard.textOffsets.size(); doc++) {
+                textOffsets.push_back(shard.textOffsets[doc] + blobOffset);
+            }
+            vector<const string*> names(shard.categoryIds.size());
+            for (const auto& [name, id] : shard.categoryIds) names[id] = &name;
+            for (uint32_t id = 0; id < names.size(); id++) {
+                auto [it, added] = categoryIds.emplace(*names[id], static_cast<uint32_t>(buildCategories.size()));
+                if (added) buildCategories.emplace_back();
+                for (uint32_t doc : shard.buildCategories[id]) buildCategories[it->second].push_back(doc + docOffset);
+            }
+            for (const auto& [trigram, docs] : shard.buildTrigrams) {
+                vector<uint32_t>& target = buildTrigrams[trigram];
+                for (uint32_t doc : docs) target.push_back(doc + docOffset);
+            }
+            shard.textBlob.clear();
+            unordered_map<uint32_t, vector<uint32_t>>().swap(shard.buildTrigrams);
+        } else if (part == MERGE_FACETS) {
+            for (int facet = 0; facet < FACET_COUNT; facet++) {
+                FacetIndex& source = shard.facets[facet];
+                for (uint32_t value = 0; value < source.labels.size(); value++) {
+                    RoaringBitmap& target = facets[facet].docs[facets[facet].valueId(source.labels[value])];
+                    source.docs[value].forEach([&](uint32_t doc) { target.add(doc + docOffset); });
+                }
+            }
+            shard.allDocs.forEach([&](uint32_t doc) { allDocs.add(doc + docOffset); });
+            for (const auto& [key, doc] : shard.docOfKey) docOfKey[key] = doc + docOffset;
+            docKeys.insert(docKeys.end(), shard.docKeys.begin(), shard.docKeys.end());
+            docRatings.insert(docRatings.end(), shard.docRatings.begin(), shard.docRatings.end());
+            docPrices.insert(docPrices.end(), shard.docPrices.begin(), shard.docPrices.end());
+        }
+    }
+
+    uint32_t findOrAddChild(uint32_t parent, char c) {
+        uint32_t prev = 0;
+        uint32_t child = buildNodes[parent].firstChild;
+        while (child && static_cast<unsigned char>(buildNodes[child].label) <
+                        static_cast<unsigned char>(c)) {
+            prev = child;
+            child = buildNodes[child].nextSibling;
+        }
+        if (child && buildNodes[child].label == c) return child;
+
+        uint32_t added = static_cast<uint32_t>(buildNodes.size());
+        buildNodes.emplace_back();
+        buildNodes[added].label = c;
+        buildNodes[added].nextSibling = child;
+        if (prev) {
+            buildNodes[prev].nextSibling = added;
+        } else {
+            buildNodes[parent].firstChild = added;
+        }
+        return added;
+    }
+
+    // Number the strings ending at terminal nodes by popularity (products
+    // carrying them, then their best product's popularity, then text) and
+    // give every node the lowest ids in its subtree. As with the postings,
+    // a reverse breadth-first sweep merges the children's runs exactly.
+    // Terms complete to their spelling, and strings that read the same
+    // share the most popular one's id.
+    void buildCompletions(const vector<uint32_t>& parents) {
+        vector<uint32_t> terminals;
+        vector<string> texts(nodes.size());
+        for (uint32_t flat = 1; flat < nodes.size(); flat++) {
+            if (!nodes[flat].isEndOfWord) continue;
+            terminals.push_back(flat);
+            vector<uint32_t> path;
+            for (uint32_t node = flat; node != 0; node = parents[node]) path.push_back(node);
+            for (size_t i = path.size(); i-- > 0;) {
+                const FlatTrieNode& edge = nodes[path[i]];
+                texts[flat].append(&labels[edge.labelOffset], edge.labelLength);
+            }
+        }
+        auto popularity = [this](uint32_t flat) {
+            const FlatTrieNode& node = nodes[flat];
+            int best = node.overflowCount ? -overflowPostings[node.overflowOffset].first : 0;
+            return make_pair(node.overflowCount, best);
+        };
+        sort(terminals.begin(), terminals.end(), [&](uint32_t a, uint32_t b) {
+            auto pa = popularity(a), pb = popularity(b);
+            if (pa != pb) return pa > pb;
+            return texts[a] < texts[b];
+        });
+
+        vector<uint32_t> completionOf(nodes.size(), UINT32_MAX);
+        unordered_map<string_view, uint32_t> idOfText;
+        completionChars.clear();
+        completionOffsets.assign(1, 0);
+        for (uint32_t terminal : terminals) {
+            const string& text = displayText(texts[terminal]);
+            auto [it, added] = idOfText.emplace(text, static_cast<uint32_t>(completionOffsets.size() - 1));
+            completionOf[terminal] = it->second;
+            if (!added) continue;
+            completionChars.insert(completionChars.end(), text.begin(), text.end());
+            completionOffsets.push_back(static_cast<uint32_t>(completionChars.size()));
+        }
+
+        completionRuns.clear();
+        vector<uint32_t> candidates;
+        for (size_t flat = nodes.size(); flat-- > 0;) {
+            FlatTrieNode& node = nodes[flat];
+            candidates.clear();
+            if (completionOf[flat] != UINT32_MAX) candidates.push_back(completionOf[flat]);
+            for (uint32_t i = 0; i < node.childCount; i++) {
+                const FlatTrieNode& child = nodes[node.firstChild + i];
+                candidates.insert(candidates.end(), completionRuns.begin() + child.completionOffset,
+                                  completionRuns.begin() + child.completionOffset + child.completionCount);
+            }
+            sort(candidates.begin(), candidates.end());
+            candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+            size_t keep = min(candidates.size(), TYPEAHEAD_TOP_N);
+            node.completionOffset = static_cast<uint32_t>(completionRuns.size());
+            node.completionCount = static_cast<uint8_t>(keep);
+            completionRuns.insert(completionRuns.end(), candidates.begin(), candidates.begin() + keep);
+        }
+    }
+
+    string completionText(uint32_t id) const {
+        return string(completionChars.begin() + completionOffsets[id],
+                      completionChars.begin() + completionOffsets[id + 1]);
+    }
+
+    // A node's own term list, most popular first, one entry per product
+    static void sortOwnPostings(vector<pair<int, int>>& own) {
+        sort(own.begin(), own.end());
+        keepBestPerProduct(own, own.size());
+    }
+
+    // Store the node's own term list (already sorted) as its overflow and
+    // merge it with the children's top-K runs. A product's best entry in the
+    // subtree is always within the top-K of the child holding it, so the
+    // merge is exact.
+    void emitPostings(FlatTrieNode& flat, TrieNode& built) {
+        auto& own = built.products;
+        flat.overflowOffset = static_cast<uint32_t>(overflowPostings.size());
+        flat.overflowCount = static_cast<uint32_t>(own.size());
+        overflowPostings.insert(overflowPostings.end(), own.begin(), own.end());
+
+        vector<pair<int, int>> candidates(own.begin(), own.begin() + min(own.size(), TOP_K));
+        for (uint32_t i = 0; i < flat.childCount; i++) {
+            const FlatTrieNode& child = nodes[flat.firstChild + i];
+            candidates.insert(candidates.end(), postings.begin() + child.postingOffset,
+                              postings.begin() + child.postingOffset + child.postingCount);
+        }
+        sort(candidates.begin(), candidates.end());
+        keepBestPerProduct(candidates, TOP_K);
+
+        flat.postingOffset = static_cast<uint32_t>(postings.size());
+        flat.postingCount = static_cast<uint16_t>(candidates.size());
+        postings.insert(postings.end(), candidates.begin(), candidates.end());
+        vector<pair<int, int>>().swap(own);
+    }
+
+    // Drop repeat products from a sorted run (first entry is the most popular)
+    static void keepBestPerProduct(vector<pair<int, int>>& run, size_t limit) {
+        unordered_set<int> seen;
+        size_t kept = 0;
+        for (size_t i = 0; i < run.size() && kept < limit; i++) {
+            if (seen.insert(run[i].second).second) {
+                run[kept++] = run[i];
+            }
+        }
+        run.resize(kept);
+    }
+
+    // First DIRECT_MATCHES postings (-popularity, doc) of the prefix node's
+    // top-K run, skipping removed docs and stopping under minPopularity
+    vector<pair<int, int>> prefixRun(const string& lowerPrefix, const RoaringBitmap* removedDocs = nullptr,
+                                     int minPopularity = INT_MIN) const {
+        vector<pair<int, int>> run;
+        uint32_t node = findPrefixNode(lowerPrefix);
+        if (node == NO_NODE) return run;
+
+        const FlatTrieNode& match = nodes[node];
+        for (uint32_t i = 0; i < match.postingCount && run.size() < DIRECT_MATCHES; i++) {
+            const pair<int, int>& posting = postings[match.postingOffset + i];
+            if (-posting.first < minPopularity) break;
+            if (removedDocs && removedDocs->contains(posting.second)) continue;
+            run.push_back(posting);
+        }
+        return run;
+    }
+
+    // Docs of prefixRun, most popular first
+    vector<uint32_t> prefixDocs(const string& lowerPrefix, const RoaringBitmap* removedDocs = nullptr,
+                                int minPopularity = INT_MIN) const {
+        vector<uint32_t> docs;
+        for (const auto& posting : prefixRun(lowerPrefix, removedDocs, minPopularity)) {
+            docs.push_back(static_cast<uint32_t>(posting.second));
+        }
+        return docs;
+    }
+
+    // Walk the frozen trie; a prefix may end partway along a compressed edge,
+    // in which case endsOnNode is false and the node's label runs past it
+    uint32_t findPrefixNode(const string& prefix, bool* endsOnNode = nullptr) const {
+        uint32_t node = 0;
+        size_t i = 0;
+        while (i < prefix.size()) {
+            const FlatTrieNode& parent = nodes[node];
+            const void* hit = memchr(&childBytes[parent.firstChild],
+                                     static_cast<unsigned char>(prefix[i]), parent.childCount);
+            if (!parent.childCount || !hit) return NO_NODE;
+
+            node = static_cast<uint32_t>(static_cast<const unsigned char*>(hit) - childBytes.data());
+            const FlatTrieNode& edge = nodes[node];
+            size_t n = min<size_t>(edge.labelLength, prefix.size() - i);
+            if (memcmp(&labels[edge.labelOffset], &prefix[i], n) != 0) return NO_NODE;
+            i += n;
+            if (endsOnNode) *endsOnNode = n == edge.labelLength;
+        }
+        if (endsOnNode && prefix.empty()) *endsOnNode = true;
+        return node;
+    }
+
+    // Typos tolerated for a query: none below 3 characters (any prefix would
+    // match), one up to 5 characters, two beyond
+    static int maxEditsFor(size_t queryLength) {
+        if (queryLength < 3) return 0;
+        return queryLength <= 5 ? 1 : 2;
+    }
+
+    // Run the query's Levenshtein automaton over the trie. An edge is pruned as
+    // soon as the automaton dies. Once the whole query is matched the walk
+    // keeps going only while a deeper node could match it with fewer edits
+    // (the automaton accepts "ipho" for "iphone" before it reaches "iphone");
+    // then the deepest node with the fewest edits credits its top-K run, which
+    // covers its subtree. Work is bounded by the query and the edit budget, not
+    // by the catalog size, and MAX_FUZZY_VISITS caps it for broad queries.
+    // The cap is part of the ranking, the same on every run, so only a walk
+    // the deadline stopped makes the search degraded.
+    FuzzyWalk collectFuzzyPrefixMatches(const string& lowerQuery, ScoreAccumulator& fuzzyScores,
+                                        const Deadline& deadline = {}) const {
+        int maxEdits = maxEditsFor(lowerQuery.length());
+        if (maxEdits == 0 || nodes.empty()) return FuzzyWalk::COMPLETE;
+
+        // A node still to walk, with the best match found on the path to it
+        struct Pending {
+            uint32_t node;
+            LevenshteinAutomaton::State state;
+            int acceptedEdits;
+            uint32_t acceptedNode;
+        };
+        auto credit = [&](uint32_t node, int edits) {
+            const FlatTrieNode& match = nodes[node];
+            double score = FUZZY_MATCH_SCORE / (1 + edits);
+            for (uint32_t p = 0; p < match.postingCount; p++) {
+                fuzzyScores.raise(postings[match.postingOffset + p].second, score);
+            }
+        };
+
+        LevenshteinAutomaton automaton(lowerQuery, maxEdits);
+        vector<Pending> stack = {{0, automaton.start(), -1, 0}};
+        size_t visits = 0;
+        while (!stack.empty()) {
+            if (visits++ >= MAX_FUZZY_VISITS) return FuzzyWalk::CAPPED;
+            if (deadline.passedAt(visits)) return FuzzyWalk::TIMED_OUT;
+            Pending parent = stack.back();
+            stack.pop_back();
+
+            for (uint32_t i = 0; i < nodes[parent.node].childCount; i++) {
+                uint32_t child = nodes[parent.node].firstChild + i;
+                const FlatTrieNode& edge = nodes[child];
+                Pending next = {child, parent.state, parent.acceptedEdits, parent.acceptedNode};
+                bool settled = false;
+                for (uint16_t j = 0; j < edge.labelLength && !settled; j++) {
+                    next.state = automaton.step(next.state, labels[edge.labelOffset + j]);
+                    if (automaton.isDead(next.state)) {
+                        settled = true;
+                        break;
+                    }
+                    int edits = automaton.acceptedEdits(next.state);
+                    if (edits >= 0 && (next.acceptedEdits < 0 || edits <= next.acceptedEdits)) {
+                        next.acceptedEdits = edits;
+                        next.acceptedNode = child;
+                    }
+                    settled = next.acceptedEdits >= 0 && !automaton.canImprove(next.state, next.acceptedEdits);
+                }
+
+                if (settled || edge.childCount == 0) {
+                    if (next.acceptedEdits >= 0) credit(next.acceptedNode, next.acceptedEdits);
+                } else {
+                    stack.push_back(next);
+                }
+            }
+        }
+        return FuzzyWalk::COMPLETE;
+    }
+
+    // Fuzzy match of an already-lowercased query against a doc's name, brand
+    // and category in the text blob: a substring hit in any field, or a field
+    // within maxEdits edits when maxEdits is non-negative. Allocation free.
+    bool isApproximateMatch(const string& lowerQuery, const MyersMatcher& matcher,
+                            int maxEdits, uint32_t doc) const {
+        const char* begin = textBlob.data() + textOffsets[doc];
+        const char* end = textBlob.data() + textOffsets[doc + 1];
+        
+        // Check if query is a substring of a field (separators never match)
+        if (findSubstring(begin, end, lowerQuery.data(), lowerQuery.size()) != end) {
+            return true;
+        }
+        if (maxEdits < 0) return false;
+
+        for (const char* field = begin; field < end;) {
+            const char* fieldEnd = static_cast<const char*>(memchr(field, FIELD_SEPARATOR, end - field));
+            if (matcher.distance(string_view(field, fieldEnd - field), maxEdits) <= maxEdits) {
+                return true;
+            }
+            field = fieldEnd + 1;
+        }
+        return false;
+    }
+};
+
+// Function to build a product from one catalog entry (server.js normalizeProduct shape)
+Product parseProduct(const json& entry) {
+    return Product(
+        entry["id"].get<int>(),
+        entry["title"].get<string>(),
+        entry["category"].get<string>(),
+        entry["rating"].get<double>(),
+        entry["stock"].get<int>(),
+        entry["price"].get<double>(),
+        entry["thumbnail"].get<string>(),
+        entry["description"].get<string>(),
+        entry["brand"].get<string>(),
+        entry["discountPercentage"].get<double>()
+    );
+}
+
+// Function to convert a parsed catalog array into products, skipping malformed entries
+vector<Product> parseProducts(const json& data) {
+    vector<Product> products;
+    if (!data.is_array()) return products;
+
+    cerr << "Input is an array with " << data.size() << " elements" << endl;
+    for (const auto& entry : data) {
+        try {
+            products.push_back(parseProduct(entry));
+        } catch (const exception& e) {
+            cerr << "Error parsing product: " << e.what() << endl;
+        }
+    }
+
+    cerr << "Total products parsed: " << products.size() << endl;
+    return products;
+}
+
+// Function to read products from stdin
+vector<Product> readProductsFromStdin() {
+    string input;
+    getline(cin, input);
+    
+    cerr << "Received input length: " << input.length() << endl;
+    
+    try {
+        json data = json::parse(input);
+        cerr << "Successfully parsed JSON" << endl;
+        return parseProducts(data);
+    } catch (const exception& e) {
+        cerr << "Error parsing input: " << e.what() << endl;
+    }
+    
+    return {};
+}
+
+// Function to read products from a catalog file
+vector<Product> readProductsFromFile(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        cerr << "Could not open catalog file: " << path << endl;
+        return {};
+    }
+
+    try {
+        json data = json::parse(file);
+        return parseProducts(data);
+    } catch (const exception& e) {
+        cerr << "Error parsing catalog file: " << e.what() << endl;
+    }
+
+    return {};
+}
+
+// Function to serialize product IDs to JSON format
+json serializeResultsToJson(const string& searchTerm, const vector<int>& productIds,
+                           const vector<string>& suggestions = {}) {
+    json result{{"searchTerm", searchTerm}, {"recommendations", productIds}};
+    if (!suggestions.empty()) {
+        result["suggestions"] = suggestions;
+    }
+    return result;
+}
+
+// Work counters of one query, for requests that ask for stats
+json serializeStatsToJson(const SearchOptions& options, const SearchStats& stats) {
+    return json{{"mode", evaluationModeName(options.mode)},
+                {"postingsTotal", stats.postingsTotal},
+                {"postingsScored", stats.postingsScored},
+                {"postingsSkipped", stats.postingsSkipped},
+                {"blocksSkipped", stats.blocksSkipped},
+                {"docsScored", stats.docsScored}};
+}
+
+// An error response. Errors in the request itself, a bad argument or a
+// field of the wrong type, are flagged invalidRequest so a client can tell
+// them from a search that failed and would not retry them elsewhere.
+json serializeErrorToJson(const string& message, bool invalidRequest) {
+    json response{{"error", message}};
+    if (invalidRequest) response["invalidRequest"] = true;
+    return response;
+}
+
+json serializeErrorToJson(const exception& e) {
+    bool invalidRequest = dynamic_cast<const invalid_argument*>(&e) || dynamic_cast<const json::exception*>(&e);
+    return serializeErrorToJson(e.what(), invalidRequest);
+}
+
+json serializeIndexSizesToJson(const IndexSizes& sizes) {
+    return json{{"trieNodes", sizes.trieNodes},
+                {"terms", sizes.terms},
+                {"postings", sizes.postings},
+                {"positions", sizes.positions},
+                {"completions", sizes.completions},
+                {"memoryBytes", sizes.memoryBytes}};
+}
+
+// Parse a request's "filters" object, e.g.
+// {"brand": ["apple", "samsung"], "price": {"min": 100, "max": 1500},
+//  "inStock": true, "exclude": {"category": ["refurbished"]}}
+// Facet values are given as a string or an array of strings; price and
+// rating also take an inclusive {"min", "max"} range or band labels.
+FacetFilter parseFacetFilter(const json& filters) {
+    auto valuesOf = [](const json& value) {
+        vector<string> values;
+        for (const json& entry : value.is_array() ? value : json::array({value})) {
+            values.push_back(entry.is_string() ? entry.get<string>() : entry.dump());
+        }
+        return values;
+    };
+
+    FacetFilter filter;
+    const json noExclusions = json::object();
+    const json& exclude = filters.contains("exclude") ? filters["exclude"] : noExclusions;
+    for (int facet = 0; facet < FACET_COUNT; facet++) {
+        const char* name = FACET_NAMES[facet];
+        if (filters.contains(name)) {
+            const json& value = filters[name];
+            if (value.is_object() && (facet == FACET_PRICE || facet == FACET_RATING)) {
+                NumericRange& range = facet == FACET_PRICE ? filter.price : filter.rating;
+                range.min = value.value("min", -HUGE_VAL);
+                range.max = value.value("max", HUGE_VAL);
+            } else {
+                filter.include[facet] = valuesOf(value);
+            }
+        }
+        if (exclude.contains(name)) {
+            filter.exclude[facet] = valuesOf(exclude[name]);
+        }
+    }
+    return filter;
+}
+
+// Facet counts as {"brand": [{"value": "apple", "count": 12}, ...], ...}
+json serializeFacetCountsToJson(const FacetCounts& counts) {
+    json result = json::object();
+    for (int facet = 0; facet < FACET_COUNT; facet++) {
+        json values = json::array();
+        for (const auto& [value, count] : counts[facet]) {
+            values.push_back(json{{"value", value}, {"count", count}});
+        }
+        result[FACET_NAMES[facet]] = values;
+    }
+    return result;
+}
+
+// A compiled plan as nested {"op", "estimate", ...} objects for explain output
+json serializePlanToJson(const QueryPlanNode& node) {
+    static const char* const OPS[] = {"all", "facet", "range", "term", "and", "or", "not", "phrase"};
+    json result{{"op", OPS[node.kind]}, {"estimate", node.estimate}};
+    if (node.facet >= 0) result["facet"] = FACET_NAMES[node.facet];
+    if (!node.value.empty()) result["value"] = node.value;
+    if (node.kind == QueryPlanNode::RANGE) {
+        if (node.range.min > -HUGE_VAL) result[node.range.minInclusive ? "gte" : "gt"] = node.range.min;
+        if (node.range.max < HUGE_VAL) result[node.range.maxInclusive ? "lte" : "lt"] = node.range.max;
+    }
+    if (node.kind == QueryPlanNode::PHRASE && node.slop) result["slop"] = node.slop;
+    if (!node.children.empty()) {
+        result["children"] = json::array();
+        for (const QueryPlanNode& child : node.children) result["children"].push_back(serializePlanToJson(child));
+    }
+    return result;
+}
+
+// The free text and filter plan of a query
+json explainQuery(const EnhancedTrie& trie, const string& query, const FacetFilter& filter) {
+    return json{{"text", parseQuery(query).text}, {"filter", serializePlanToJson(trie.planQuery(query, filter))}};
+}
+
+// The searchable catalog: an immutable base index (built or mapped) plus the
+// products changed since it was built. Upserted and removed products mask
+// their base docs; upserted products live in delta segments, small indexes
+// frozen against the base so their scores compare with base scores. Each
+// update adds a segment for its batch and only masks the products it
+// replaces in older segments; a segment merges with the one before it once
+// it holds at least 1 / DELTA_MERGE_RATIO as many products, so a product is
+// re-indexed O(log n) times however many updates follow. Each update yields
+// a new CatalogIndex sharing the base and the segments, never changing this
+// one.
+class CatalogIndex {
+public:
+    static constexpr size_t DELTA_MERGE_RATIO = 2;
+
+    explicit CatalogIndex(shared_ptr<const EnhancedTrie> base) : base(move(base)) {}
+
+    // A new version with products upserted (inserted or replaced by key)
+    // and keys removed
+    CatalogIndex* withUpdates(const vector<Product>& upserts, const vector<int>& removals) const {
+        auto next = make_unique<CatalogIndex>(*this);
+        map<int, Product> batch;
+        for (const Product& product : upserts) {
+            batch[product.key] = product;
+            next->maskKey(product.key);
+        }
+        for (int key : removals) {
+            batch.erase(key);
+            next->maskKey(key);
+        }
+        sealMask(next->removedDocs, next->removed);
+        for (DeltaSegment& segment : next->segments) sealMask(segment.maskedDocs, segment.masked);
+
+        if (!batch.empty()) next->segments.push_back(next->freezeSegment(move(batch)));
+        next->mergeSegments();
+        return next.release();
+    }
+
+    vector<int> advancedSearch(const string& query, const SearchOptions& options = {},
+                               SearchStats* stats = nullptr, FacetCounts* facetCounts = nullptr) const {
+        vector<int> results;
+        for (const auto& entry : rankedPage(query, options, stats, facetCounts)) results.push_back(entry.second);
+        return results;
+    }
+
+    // Results on a page of query's ranking when options leave the limit open
+    size_t pageLimit(const string& query, const SearchOptions& options) const {
+        if (options.limit) return options.limit;
+        size_t limit = base->resultLimit(query);
+        for (const DeltaSegment& segment : segments) limit = max(limit, segment.index->resultLimit(query));
+        return limit;
+    }
+
+    // advancedSearch's page over the merged catalog: each index ranks its
+    // own best results and the lists merge by score
+    vector<pair<double, int>> rankedPage(const string& query, const SearchOptions& options,
+                                         SearchStats* stats = nullptr, FacetCounts* facetCounts = nullptr) const {
+        if (!hasUpdates()) return base->rankedPage(query, options, stats, facetCounts);
+
+        size_t limit = options.offset + pageLimit(query, options);
+        int minDirectPopularity = INT_MIN;
+        if (!segments.empty()) {
+            // Direct matches are the merged catalog's most popular, not each index's
+            vector<int> popularities = base->directMatchPopularities(query, &removed);
+            for (const DeltaSegment& segment : segments) {
+                vector<int> more = segment.index->directMatchPopularities(query, &segment.masked);
+                popularities.insert(popularities.end(), more.begin(), more.end());
+            }
+            if (popularities.size() > EnhancedTrie::DIRECT_MATCHES) {
+                nth_element(popularities.begin(), popularities.begin() + EnhancedTrie::DIRECT_MATCHES - 1,
+                            popularities.end(), greater<int>());
+                minDirectPopularity = popularities[EnhancedTrie::DIRECT_MATCHES - 1];
+            }
+        }
+
+        vector<pair<double, int>> ranked = base->rankedSearch(query, options, limit,
+                                                              SearchMask{&removed, minDirectPopularity},
+                                                              stats, facetCounts);
+        for (const DeltaSegment& segment : segments) {
+            SearchStats deltaStats;
+            FacetCounts deltaFacets;
+            vector<pair<double, int>> more = segment.index->rankedSearch(
+                query, options, limit, SearchMask{&segment.masked, minDirectPopularity}, &deltaStats,
+                facetCounts ? &deltaFacets : nullptr);
+            ranked.insert(ranked.end(), more.begin(), more.end());
+            if (stats) addStats(*stats, deltaStats);
+            if (facetCounts) mergeFacetCounts(*facetCounts, deltaFacets);
+        }
+        sort(ranked.begin(), ranked.end(), greater<pair<double, int>>());
+        if (ranked.size() > limit) ranked.resize(limit);
+        ranked.erase(ranked.begin(), ranked.begin() + min(options.offset, ranked.size()));
+        return ranked;
+    }
+
+    // A page of searchByCategory's ranking: limit results after the cursor,
+    // less the first offset
+    vector<pair<double, int>> rankedCategoryPage(const string& category, const ResultCursor& after,
+                                                 size_t offset, size_t limit) const {
+        if (!hasUpdates()) return base->rankedCategoryPage(category, after, offset, limit, nullptr);
+
+        vector<pair<double, int>> ranked = base->rankedCategoryPage(category, after, 0, offset + limit, &removed);
+        for (const DeltaSegment& segment : segments) {
+            vector<pair<double, int>> more = segment.index->rankedCategoryPage(category, after, 0, offset + limit,
+                                                                               &segment.masked);
+            mergeRanked(ranked, more);
+        }
+        ranked.erase(ranked.begin(), ranked.begin() + min(offset, ranked.size()));
+        if (ranked.size() > limit) ranked.resize(limit);
+        return ranked;
+    }
+
+    vector<int> searchByCategory(const string& category) const {
+        if (!hasUpdates()) return base->searchByCategory(category);
+
+        vector<pair<double, int>> ranked = base->rankedCategory(category, &removed);
+        for (const DeltaSegment& segment : segments) {
+            mergeRanked(ranked, segment.index->rankedCategory(category, &segment.masked));
+        }
+
+        vector<int> results;
+        for (const auto& entry : ranked) results.push_back(entry.second);
+        return results;
+    }
+
+    // Base completions first, then any only a delta segment has. Strings of
+    // replaced or removed products stay until the segment merges or the next
+    // full reload.
+    vector<string> completions(const string& prefix, size_t limit = EnhancedTrie::TYPEAHEAD_TOP_N) const {
+        vector<string> results = base->completions(prefix, limit);
+        for (const DeltaSegment& segment : segments) {
+            for (const string& completion : segment.index->completions(prefix, limit)) {
+                if (results.size() == limit) return results;
+                if (find(results.begin(), results.end(), completion) == results.end()) {
+                    results.push_back(completion);
+                }
+            }
+        }
+        return results;
+    }
+
+    // Base corrections, unless the delta segments know every word the base
+    // does not
+    vector<string> suggestCorrections(const string& query) const {
+        if (!segments.empty()) {
+            bool known = true;
+            for (const string& word : EnhancedTrie::splitWords(parseQuery(query).text)) {
+                bool anywhere = base->isKnownTerm(word);
+                for (const DeltaSegment& segment : segments) anywhere = anywhere || segment.index->isKnownTerm(word);
+                known = known && anywhere;
+            }
+            if (known) return {};
+        }
+        return base->suggestCorrections(query);
+    }
+
+    size_t productCount() const {
+        size_t count = base->productCount() - removedDocs.size();
+        for (const DeltaSegment& segment : segments) count += segment.liveCount();
+        return count;
+    }
+
+    // True once updates were applied since the base was built
+    bool hasUpdates() const {
+        return !segments.empty() || !removedDocs.empty();
+    }
+
+    const EnhancedTrie& baseIndex() const {
+        return *base;
+    }
+
+    // Engine generation this version was published as; 0 until published
+    uint64_t generation() const {
+        return publishedAs;
+    }
+
+    void setGeneration(uint64_t value) {
+        publishedAs = value;
+    }
+
+private:
+    // The products of one or more update batches and their index. Versions
+    // share the products and index; each keeps its own mask of the docs later
+    // updates replaced or removed.
+    struct DeltaSegment {
+        shared_ptr<const map<int, Product>> products;  // by key
+        shared_ptr<const EnhancedTrie> index;
+        vector<uint32_t> maskedDocs;  // sorted
+        RoaringBitmap masked;
+
+        size_t liveCount() const {
+            return products->size() - maskedDocs.size();
+        }
+    };
+
+    shared_ptr<const EnhancedTrie> base;
+    uint64_t publishedAs = 0;
+    vector<uint32_t> removedDocs;  // base docs masked by an update, sorted
+    RoaringBitmap removed;
+    vector<DeltaSegment> segments;  // oldest first, each under half the size of the one before
+
+    // Hide a key's current doc, in the base or whichever segment holds it
+    void maskKey(int key) {
+        uint32_t doc = base->docOf(key);
+        if (doc != EnhancedTrie::NO_DOC) removedDocs.push_back(doc);
+        for (DeltaSegment& segment : segments) {
+            doc = segment.index->docOf(key);
+            if (doc != EnhancedTrie::NO_DOC) segment.maskedDocs.push_back(doc);
+        }
+    }
+
+    static void sealMask(vector<uint32_t>& docs, RoaringBitmap& set) {
+        sort(docs.begin(), docs.end());
+        docs.erase(unique(docs.begin(), docs.end()), docs.end());
+        set = RoaringBitmap::fromSorted(docs.data(), docs.size());
+    }
+
+    DeltaSegment freezeSegment(map<int, Product> products) const {
+        auto index = make_shared<EnhancedTrie>();
+        for (const auto& entry : products) index->insertProduct(entry.second);
+        index->freeze(base.get(), &removedDocs);
+        return DeltaSegment{make_shared<const map<int, Product>>(move(products)), move(index), {}, {}};
+    }
+
+    // Drop segments every product of which was replaced or removed, then
+    // re-index the newest segments as one while the last is no longer small
+    // next to the one before; masked products drop out
+    void mergeSegments() {
+        segments.erase(remove_if(segments.begin(), segments.end(),
+                                 [](const DeltaSegment& segment) { return segment.liveCount() == 0; }),
+                       segments.end());
+        while (segments.size() > 1 &&
+               segments.back().liveCount() * DELTA_MERGE_RATIO >= segments[segments.size() - 2].liveCount()) {
+            map<int, Product> merged;
+            for (size_t i = segments.size() - 2; i < segments.size(); i++) {
+                const DeltaSegment& segment = segments[i];
+                for (const auto& [key, product] : *segment.products) {
+                    if (!segment.masked.contains(segment.index->docOf(key))) merged[key] = product;
+                }
+            }
+            segments.resize(segments.size() - 2);
+            segments.push_back(freezeSegment(move(merged)));
+        }
+    }
+
+    static void mergeRanked(vector<pair<double, int>>& ranked, const vector<pair<double, int>>& more) {
+        vector<pair<double, int>> merged;
+        merge(ranked.begin(), ranked.end(), more.begin(), more.end(), back_inserter(merged),
+              greater<pair<double, int>>());
+        ranked.swap(merged);
+    }
+
+    static void addStats(SearchStats& total, const SearchStats& more) {
+        total.postingsTotal += more.postingsTotal;
+        total.postingsScored += more.postingsScored;
+        total.postingsSkipped += more.postingsSkipped;
+        total.blocksSkipped += more.blocksSkipped;
+        total.docsScored += more.docsScored;
+        total.degraded = total.degraded || more.degraded;
+    }
+
+    // Sum counts by label. Brands and categories are then re-ranked by count
+    // as countFacets ranks them; bands go back into band order.
+    void mergeFacetCounts(FacetCounts& total, const FacetCounts& more) const {
+        for (int facet = 0; facet < FACET_COUNT; facet++) {
+            auto& counts = total[facet];
+            for (const auto& [value, count] : more[facet]) {
+                auto it = find_if(counts.begin(), counts.end(), [&](const auto& entry) { return entry.first == value; });
+                if (it != counts.end()) {
+                    it->second += count;
+                } else {
+                    counts.push_back({value, count});
+                }
+            }
+            if (facet == FACET_BRAND || facet == FACET_CATEGORY) {
+                stable_sort(counts.begin(), counts.end(),
+                            [](const auto& a, const auto& b) { return a.second > b.second; });
+            } else {
+                stable_sort(counts.begin(), counts.end(), [this, facet](const auto& a, const auto& b) {
+                    return base->facetValueId(facet, a.first) < base->facetValueId(facet, b.first);
+                });
+            }
+        }
+    }
+};
+
+// Epoch-based reclamation. A reader pins the global epoch before loading a
+// published pointer and unpins when done; a writer that replaces the pointer
+// retires the old object under the current epoch and bumps it. The object is
+// freed once every pinned reader's epoch is newer than its retirement epoch,
+// so readers never lock and never see a freed object.
+class EpochReclaimer {
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{IDLE};
+        atomic<bool> claimed{false};
+        uint32_t depth = 0;  // nested pins, touched only by the owning thread
+        ReaderSlot* next = nullptr;
+    };
+
+public:
+    // Keeps objects retired from now on alive until released. Pins nest.
+    class Guard {
+    public:
+        explicit Guard(ReaderSlot* slot, EpochReclaimer& owner) : slot(slot), owner(&owner) {}
+        Guard(Guard&& other) noexcept : slot(other.slot), owner(other.owner) { other.slot = nullptr; }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard() {
+            if (slot && --slot->depth == 0) {
+                slot->epoch.store(IDLE, memory_order_release);
+                if (owner->pending.load(memory_order_relaxed)) owner->collect(false);
+            }
+        }
+
+    private:
+        ReaderSlot* slot;
+        EpochReclaimer* owner;
+    };
+
+    EpochReclaimer() = default;
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    // Slots stay on the list for the process lifetime: threads that exit
+    // give theirs back for reuse, but one may still be reading the list.
+    ~EpochReclaimer() {
+        for (auto& entry : retired) entry.second();
+    }
+
+    Guard pin() {
+        ReaderSlot* slot = threadSlot();
+        if (slot->depth++ == 0) {
+            slot->epoch.store(epoch.load());
+        }
+        return Guard(slot, *this);
+    }
+
+    // Run free once no reader can still hold what it releases
+    void retire(function<void()> free) {
+        {
+            lock_guard<mutex> lock(retiredMutex);
+            retired.push_back({epoch.fetch_add(1), move(free)});
+            pending.store(retired.size(), memory_order_relaxed);
+        }
+        collect(true);
+    }
+
+private:
+    static constexpr uint64_t IDLE = UINT64_MAX;
+
+    atomic<uint64_t> epoch{1};
+    atomic<ReaderSlot*> slots{nullptr};
+    atomic<size_t> pending{0};
+    mutex retiredMutex;
+    vector<pair<uint64_t, function<void()>>> retired;
+
+    // Free what every active reader has moved past. Readers only try, so
+    // unpinning never waits on a writer.
+    void collect(bool wait) {
+        unique_lock<mutex> lock(retiredMutex, defer_lock);
+        if (wait) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            return;
+        }
+        uint64_t oldest = IDLE;
+        for (ReaderSlot* slot = slots.load(memory_order_acquire); slot; slot = slot->next) {
+            oldest = min(oldest, slot->epoch.load());
+        }
+        vector<function<void()>> ready;
+        auto kept = partition(retired.begin(), retired.end(),
+                              [oldest](const auto& entry) { return entry.first >= oldest; });
+        for (auto it = kept; it != retired.end(); ++it) ready.push_back(move(it->second));
+        retired.erase(kept, retired.end());
+        pending.store(retired.size(), memory_order_relaxed);
+        lock.unlock();
+        for (auto& free : ready) free();
+    }
+
+    // This thread's slot, claimed on first use and released when it exits
+    ReaderSlot* threadSlot() {
+        struct Lease {
+            vector<pair<EpochReclaimer*, ReaderSlot*>> held;
+            ~Lease() {
+                for (auto& entry : held) entry.second->claimed.store(false, memory_order_release);
+            }
+        };
+        static thread_local Lease lease;
+        for (const auto& entry : lease.held) {
+            if (entry.first == this) return entry.second;
+        }
+
+        ReaderSlot* slot = slots.load(memory_order_acquire);
+        for (; slot; slot = slot->next) {
+            bool expected = false;
+            if (!slot->claimed.load(memory_order_relaxed) && slot->claimed.compare_exchange_strong(expected, true)) {
+                break;
+            }
+        }
+        if (!slot) {
+            slot = new ReaderSlot;
+            slot->claimed.store(true, memory_order_relaxed);
+            slot->next = slots.load(memory_order_relaxed);
+            while (!slots.compare_exchange_weak(slot->next, slot)) {
+            }
+        }
+        lease.held.push_back({this, slot});
+        return slot;
+    }
+};
+
+// Search responses for repeated requests, keyed on the normalized request and
+// tagged with the catalog generation they were computed on: an entry from any
+// other generation is a miss, so a reload or update invalidates the whole
+// cache at once without touching it. Keys hash to one of SHARDS shards, each
+// behind its own lock, and eviction is CLOCK (second chance), so a hit only
+// finds the slot, sets its reference bit and copies a shared_ptr under the
+// lock; the response itself is copied after unlocking.
+class ResultCache {
+public:
+    static constexpr size_t SHARDS = 16;
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    explicit ResultCache(size_t capacity) {
+        size_t perShard = (capacity + SHARDS - 1) / SHARDS;
+        for (Shard& shard : shards) shard.capacity = perShard;
+    }
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    bool enabled() const {
+        return shards[0].capacity > 0;
+    }
+
+    // Copy the cached response for key into response if it is from generation
+    bool lookup(const string& key, uint64_t generation, json& response) {
+        if (!enabled()) return false;
+        shared_ptr<const json> cached;
+        {
+            Shard& shard = shardFor(key);
+            lock_guard<mutex> lock(shard.lock);
+            auto it = shard.slots.find(key);
+            if (it != shard.slots.end() && shard.entries[it->second].generation == generation) {
+                Entry& entry = shard.entries[it->second];
+                entry.referenced = true;
+                cached = entry.response;
+            }
+        }
+        if (!cached) {
+            misses.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        hits.fetch_add(1, memory_order_relaxed);
+        response = *cached;
+        return true;
+    }
+
+    void insert(const string& key, uint64_t generation, const json& response) {
+        if (!enabled()) return;
+        auto cached = make_shared<const json>(response);
+        Shard& shard = shardFor(key);
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.slots.find(key);
+        if (it != shard.slots.end()) {
+            Entry& entry = shard.entries[it->second];
+            entry.generation = generation;
+            entry.response = move(cached);
+            entry.referenced = true;
+            return;
+        }
+
+        size_t slot;
+        if (shard.entries.size() < shard.capacity) {
+            slot = shard.entries.size();
+            shard.entries.emplace_back();
+        } else {
+            slot = shard.victim(generation);
+            shard.slots.erase(shard.entries[slot].key);
+        }
+        Entry& entry = shard.entries[slot];
+        entry.key = key;
+        entry.generation = generation;
+        entry.response = move(cached);
+        entry.referenced = false;  // earns its second chance with the first hit
+        shard.slots.emplace(key, slot);
+    }
+
+    json statsJson() const {
+        size_t entries = 0;
+        for (const Shard& shard : shards) {
+            lock_guard<mutex> lock(shard.lock);
+            entries += shard.entries.size();
+        }
+        return json{{"hits", hits.load(memory_order_relaxed)},
+                    {"misses", misses.load(memory_order_relaxed)},
+                    {"entries", entries},
+                    {"capacity", shards[0].capacity * SHARDS}};
+    }
+
+private:
+    struct Entry {
+        string key;
+        uint64_t generation = 0;
+        shared_ptr<const json> response;
+        bool referenced = false;
+    };
+
+    struct alignas(64) Shard {
+        mutable mutex lock;
+        unordered_map<string, size_t> slots;  // key -> index into entries
+        vector<Entry> entries;
+        size_t hand = 0;
+        size_t capacity = 0;
+
+        // Sweep the clock hand to the first entry that is stale or has not
+        // been hit since the hand last passed it
+        size_t victim(uint64_t generation) {
+            while (true) {
+                Entry& entry = entries[hand];
+                size_t slot = hand;
+                hand = (hand + 1) % entries.size();
+                if (entry.generation != generation || !entry.referenced) return slot;
+                entry.referenced = false;
+            }
+        }
+    };
+
+    array<Shard, SHARDS> shards;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+
+    Shard& shardFor(const string& key) {
+        return shards[hash<string>()(key) % SHARDS];
+    }
+};
+
+// Space-Saving heavy hitters (Metwally et al.) over at most capacity
+// counters. An unseen key takes over the smallest counter and inherits its
+// count as error, so any key seen more than total / capacity times is
+// always kept, and a count overstates the true one by at most its error.
+// Counters form a min-heap on count so the takeover is O(log capacity).
+template <typename T>
+class SpaceSaving {
+public:
+    struct Counter {
+        string key;
+        T item;
+        uint64_t count = 0;
+        uint64_t error = 0;
+    };
+
+    explicit SpaceSaving(size_t capacity) : capacity(capacity) {}
+
+    void offer(const string& key, const T& item) {
+        total++;
+        auto it = position.find(key);
+        if (it != position.end()) {
+            counters[it->second].count++;
+            siftDown(it->second);
+            return;
+        }
+        if (counters.size() < capacity) {
+            counters.push_back(Counter{key, item, 1, 0});
+            position[key] = counters.size() - 1;
+            siftUp(counters.size() - 1);
+            return;
+        }
+        Counter& smallest = counters[0];
+        position.erase(smallest.key);
+        smallest.error = smallest.count;
+        smallest.count++;
+        smallest.key = key;
+        smallest.item = item;
+        position[key] = 0;
+        siftDown(0);
+    }
+
+    // The k largest counters, most frequent first
+    vector<Counter> top(size_t k) const {
+        vector<Counter> result(counters);
+        auto byCount = [](const Counter& a, const Counter& b) {
+            return a.count != b.count ? a.count > b.count : a.key < b.key;
+        };
+        k = min(k, result.size());
+        partial_sort(result.begin(), result.begin() + k, result.end(), byCount);
+        result.resize(k);
+        return result;
+    }
+
+    uint64_t offered() const {
+        return total;
+    }
+
+private:
+    size_t capacity;
+    uint64_t total = 0;
+    vector<Counter> counters;  // min-heap on count
+    unordered_map<string, size_t> position;
+
+    void swapCounters(size_t a, size_t b) {
+        swap(counters[a], counters[b]);
+        position[counters[a].key] = a;
+        position[counters[b].key] = b;
+    }
+
+    void siftUp(size_t i) {
+        while (i > 0 && counters[i].count < counters[(i - 1) / 2].count) {
+            swapCounters(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void siftDown(size_t i) {
+        while (true) {
+            size_t smallest = i;
+            for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < counters.size(); child++) {
+                if (counters[child].count < counters[smallest].count) smallest = child;
+            }
+            if (smallest == i) return;
+            swapCounters(i, smallest);
+            i = smallest;
+        }
+    }
 };
 
-// Enhanced Trie Class with multiple indexing strategies
-class EnhancedTrie {
-public:
-    TrieNode* root;
-    unordered_map<int, Product> productMap;  // Store actual product data
-    
-    EnhancedTrie() {
-        root = new TrieNode();
+// Long-running search engine: keeps the built trie resident between queries.
+// Readers pin the published catalog through epoch-based reclamation and never
+// lock, so neither a reload nor an incremental update blocks them; writers
+// build the next version off to the side, swap it in and retire the old one.
+// The most frequent searches are tracked and their responses kept ready for
+// the current catalog by a background refresher.
+class SearchEngine {
+public:
+    static constexpr size_t HEAVY_HITTER_COUNTERS = 1024;
+    static constexpr size_t HOT_QUERIES = 64;       // responses kept materialized
+    static constexpr uint64_t HOT_MIN_COUNT = 3;    // guaranteed count to qualify
+    static constexpr chrono::seconds HOT_REFRESH_INTERVAL{10};
+    static constexpr size_t MAX_RESULT_LIMIT = 500;
+    static constexpr size_t MAX_OFFSET = 1000;          // deeper pages go by cursor
+    static constexpr size_t CATEGORY_PAGE_SIZE = 50;   // paged category requests without a limit
+    static constexpr size_t MAX_BATCH_QUERIES = 256;
+
+    // Catalog builds run on threads workers; up to cacheEntries search
+    // responses are cached (0 turns off caching and hot responses)
+    explicit SearchEngine(size_t threads, size_t cacheEntries = ResultCache::DEFAULT_CAPACITY)
+        : buildPool(threads), queryPool(threads), resultCache(cacheEntries), heavyHitters(HEAVY_HITTER_COUNTERS) {
+        if (resultCache.enabled()) {
+            refresher = thread([this]() { refreshLoop(); });
+        }
+    }
+
+    ~SearchEngine() {
+        {
+            lock_guard<mutex> lock(refreshMutex);
+            stopping = true;
+        }
+        refreshWake.notify_one();
+        if (refresher.joinable()) refresher.join();
+        delete hot.load();
+        delete current.load();
+    }
+
+    // Build a fresh trie for the catalog and publish it
+    size_t reload(const vector<Product>& products) {
+        auto fresh = make_shared<EnhancedTrie>();
+        fresh->insertProducts(products, buildPool);
+        fresh->freeze(buildPool);
+        lock_guard<mutex> lock(writeMutex);
+        publish(new CatalogIndex(move(fresh)));
+        return products.size();
+    }
+
+    // Publish an index file written by saveIndex, mapped rather than rebuilt
+    size_t loadIndex(const string& path, bool verifyPayload = false) {
+        auto fresh = make_shared<EnhancedTrie>();
+        if (!fresh->loadIndex(path, verifyPayload)) {
+            throw runtime_error("Could not load index " + path);
+        }
+        size_t count = fresh->productCount();
+        lock_guard<mutex> lock(writeMutex);
+        publish(new CatalogIndex(move(fresh)));
+        return count;
+    }
+
+    // Upsert and remove products in the published catalog without a rebuild
+    size_t update(const vector<Product>& upserts, const vector<int>& removals) {
+        lock_guard<mutex> lock(writeMutex);
+        const CatalogIndex* catalog = current.load();
+        if (!catalog) {
+            throw runtime_error("No catalog loaded; send a reload request first");
+        }
+        CatalogIndex* next = catalog->withUpdates(upserts, removals);
+        publish(next);
+        return next->productCount();
+    }
+
+    uint64_t catalogGeneration() const {
+        return generation.load();
+    }
+
+    // Run an array of search requests (search op objects without "op");
+    // see runBatch
+    json batch(const json& queries) {
+        if (!queries.is_array()) {
+            throw invalid_argument("Batch queries must be an array");
+        }
+        if (queries.size() > MAX_BATCH_QUERIES) {
+            throw invalid_argument("Batch holds more than " + to_string(MAX_BATCH_QUERIES) + " queries");
+        }
+        return runBatch(queries);
+    }
+
+    // Latency budget for searches that do not carry their own "budgetMs";
+    // zero means none
+    void setSearchBudget(chrono::microseconds budget) {
+        defaultBudget = budget;
+    }
+
+    // Handle one request. Bare text is treated as a search term; JSON objects
+    // carry an "op" of search, batch (many searches), typeahead, category,
+    // reload, update, save, hot (the most frequent searches) or ping.
+    json handleRequest(const string& payload) {
+        if (payload.empty() || payload[0] != '{') {
+            SearchRequest search;
+            search.searchTerm = payload;
+            search.budget = defaultBudget;
+            try {
+                return runSearch(search);
+            } catch (const exception& e) {
+                return serializeErrorToJson(e);
+            }
+        }
+
+        json request;
+        try {
+            request = json::parse(payload);
+        } catch (const exception& e) {
+            return serializeErrorToJson(string("Invalid request: ") + e.what(), true);
+        }
+
+        json response;
+        try {
+            response = dispatch(request);
+        } catch (const exception& e) {
+            response = serializeErrorToJson(e);
+        }
+        if (request.contains("id")) {
+            response["id"] = request["id"];
+        }
+        return response;
+    }
+
+private:
+    // One search as requested; filtersKey is the filters in canonical form,
+    // empty for none. The budget is not part of the cache key: a complete
+    // response answers any budget, and degraded ones are never cached.
+    struct SearchRequest {
+        string searchTerm;
+        SearchOptions options;
+        bool withStats = false;
+        bool withFacets = false;
+        string filtersKey;
+        chrono::microseconds budget{0};
+        bool paged = false;  // asked for a limit, offset or cursor, so gets a nextCursor
+        string cursorToken;
+    };
+
+    // A request's offset, limit and cursor
+    struct PageRequest {
+        bool requested = false;
+        size_t offset = 0;
+        size_t limit = 0;
+        ResultCursor after;
+        string cursorToken;
+    };
+
+    // Responses materialized for the heavy hitters, all for one generation
+    struct HotResults {
+        uint64_t generation = 0;
+        unordered_map<string, shared_ptr<const json>> responses;
+    };
+
+    // The published catalog, held for as long as the pin lives
+    struct PinnedCatalog {
+        EpochReclaimer::Guard guard;
+        const CatalogIndex* catalog;
+
+        const CatalogIndex* operator->() const { return catalog; }
+    };
+
+    atomic<const CatalogIndex*> current{nullptr};
+    atomic<uint64_t> generation{0};
+    mutex writeMutex;  // serializes reload, loadIndex and update
+    chrono::microseconds defaultBudget{0};
+    mutable EpochReclaimer reclaimer;
+    WorkerPool buildPool;
+    WorkerPool queryPool;  // batch queries; concurrent batches take turns
+    ResultCache resultCache;
+
+    // Frequent searches by cache key. Recording only try-locks, so under
+    // contention the sketch sees a sample of the stream, which still ranks
+    // the heavy hitters.
+    mutex heavyHittersMutex;
+    SpaceSaving<SearchRequest> heavyHitters;
+    atomic<const HotResults*> hot{nullptr};  // replaced only by the refresher
+    atomic<uint64_t> hotHits{0};
+
+    mutex refreshMutex;
+    condition_variable refreshWake;
+    bool refreshRequested = false;
+    bool stopping = false;
+    thread refresher;
+
+    // Swap in the next catalog; the caller holds writeMutex. The generation
+    // is stamped on the catalog first, so a reader that pinned it knows
+    // exactly which version its results came from.
+    void publish(CatalogIndex* fresh) {
+        fresh->setGeneration(generation.load() + 1);
+        const CatalogIndex* previous = current.exchange(fresh);
+        generation++;
+        if (previous) reclaimer.retire([previous]() { delete previous; });
+        {
+            lock_guard<mutex> lock(refreshMutex);
+            refreshRequested = true;
+        }
+        refreshWake.notify_one();
     }
-    
-    // Helper function to convert string to lowercase
-    static string toLowerCase(const string& str) {
-        string lowerStr = str;
-        transform(lowerStr.begin(), lowerStr.end(), lowerStr.begin(), ::tolower);
-        return lowerStr;
+
+    PinnedCatalog pinCatalog() const {
+        EpochReclaimer::Guard guard = reclaimer.pin();
+        return PinnedCatalog{move(guard), current.load()};
     }
 
-    // Helper function to split string into words
-    static vector<string> splitWords(const string& str) {
-        vector<string> words;
-        stringstream ss(str);
-        string word;
-        while (ss >> word) {
-            // Remove punctuation
-            word.erase(remove_if(word.begin(), word.end(), 
-                [](char c) { return !isalnum(c); }), word.end());
-            if (!word.empty()) {
-                words.push_back(toLowerCase(word));
+    PinnedCatalog requireCatalog() const {
+        PinnedCatalog pinned = pinCatalog();
+        if (!pinned.catalog) {
+            throw runtime_error("No catalog loaded; send a reload request first");
+        }
+        return pinned;
+    }
+
+    json dispatch(const json& request) {
+        string op = request.value("op", "search");
+
+        if (op == "search") {
+            SearchRequest search = parseSearchRequest(request);
+            json result = runSearch(search);
+            if (request.value("explain", false)) {
+                result["plan"] = explainQuery(requireCatalog()->baseIndex(), search.searchTerm, search.options.filter);
+            }
+            return result;
+        }
+        if (op == "batch") {
+            return json{{"results", batch(request.at("queries"))}};
+        }
+        if (op == "typeahead") {
+            PinnedCatalog catalog = requireCatalog();
+            string prefix = request.at("q").get<string>();
+            size_t limit = request.value("limit", EnhancedTrie::TYPEAHEAD_TOP_N);
+            return json{{"searchTerm", prefix}, {"completions", catalog->completions(prefix, limit)}};
+        }
+        if (op == "category") {
+            PinnedCatalog catalog = requireCatalog();
+            string category = request.at("category").get<string>();
+            uint32_t fingerprint = cursorFingerprint("category\x1f" + asciiLower(category));
+            PageRequest page = parsePageRequest(request, fingerprint);
+            if (!page.requested) {
+                return serializeResultsToJson(category, catalog->searchByCategory(category));
+            }
+            size_t limit = page.limit ? page.limit : CATEGORY_PAGE_SIZE;
+            vector<pair<double, int>> ranked = catalog->rankedCategoryPage(category, page.after, page.offset, limit);
+            vector<int> results;
+            for (const auto& entry : ranked) results.push_back(entry.second);
+            json result = serializeResultsToJson(category, results);
+            if (ranked.size() == limit) result["nextCursor"] = encodeCursor(ranked.back(), fingerprint);
+            return result;
+        }
+        if (op == "reload" && request.contains("index")) {
+            size_t count = loadIndex(request["index"].get<string>(), request.value("verify", false));
+            return json{{"ok", true}, {"products", count}, {"generation", catalogGeneration()}};
+        }
+        if (op == "reload") {
+            vector<Product> products = request.contains("products")
+                ? parseProducts(request["products"])
+                : readProductsFromFile(request.at("path").get<string>());
+            if (products.empty()) {
+                return json{{"error", "No products in reload request"}};
             }
+            size_t count = reload(products);
+            return json{{"ok", true}, {"products", count}, {"generation", catalogGeneration()}};
         }
-        return words;
+        if (op == "update") {
+            vector<Product> upserts = request.contains("upsert") ? parseProducts(request["upsert"]) : vector<Product>{};
+            vector<int> removals = request.value("remove", vector<int>{});
+            size_t count = update(upserts, removals);
+            return json{{"ok", true},
+                        {"products", count},
+                        {"upserted", upserts.size()},
+                        {"removed", removals.size()},
+                        {"generation", catalogGeneration()}};
+        }
+        if (op == "save") {
+            string path = request.at("path").get<string>();
+            PinnedCatalog catalog = requireCatalog();
+            if (catalog->hasUpdates()) {
+                return json{{"error", "Catalog has incremental updates; reload it before saving"}};
+            }
+            if (!catalog->baseIndex().saveIndex(path)) {
+                return json{{"error", "Could not write index " + path}};
+            }
+            return json{{"ok", true}, {"path", path}, {"generation", catalogGeneration()}};
+        }
+        if (op == "ping") {
+            PinnedCatalog catalog = pinCatalog();
+            return json{{"ok", true},
+                        {"products", catalog.catalog ? catalog->productCount() : 0},
+                        {"generation", catalogGeneration()},
+                        {"cache", resultCache.statsJson()},
+                        {"hotHits", hotHits.load(memory_order_relaxed)}};
+        }
+        if (op == "hot") {
+            size_t limit = request.value("limit", HOT_QUERIES);
+            vector<SpaceSaving<SearchRequest>::Counter> top;
+            uint64_t offered;
+            {
+                lock_guard<mutex> lock(heavyHittersMutex);
+                top = heavyHitters.top(limit);
+                offered = heavyHitters.offered();
+            }
+            PinnedCatalog catalog = pinCatalog();
+            const HotResults* materialized = hot.load();
+            bool current = catalog.catalog && materialized && materialized->generation == catalog->generation();
+            json queries = json::array();
+            for (const auto& counter : top) {
+                queries.push_back(json{{"q", counter.item.searchTerm},
+                                       {"count", counter.count},
+                                       {"error", counter.error},
+                                       {"materialized", current && materialized->responses.count(counter.key) > 0}});
+            }
+            return json{{"searches", offered}, {"queries", queries}};
+        }
+
+        return serializeErrorToJson("Unknown op: " + op, true);
     }
 
-    // Insert a single term into the trie
-    void insertTerm(const string& term, int popularity, int productId) {
-        string lowerTerm = toLowerCase(term);
-        TrieNode* node = root;
-        for (char c : lowerTerm) {
-            if (!node->children[c]) {
-                node->children[c] = new TrieNode();
+    // Cache key for a search. Case never changes results (terms and filter
+    // values are lowercased before matching), but spacing can: a plain query
+    // prefix-matches exactly as typed, so it is kept.
+    static string searchCacheKey(const SearchRequest& request) {
+        string key = asciiLower(request.searchTerm);
+        key += '\x1f';
+        key += request.filtersKey;
+        key += '\x1f';
+        key += evaluationModeName(request.options.mode);
+        key += request.options.limit ? "|limit=" + to_string(request.options.limit) : "";
+        key += request.options.offset ? "|offset=" + to_string(request.options.offset) : "";
+        key += request.cursorToken.empty() ? "" : "|after=" + request.cursorToken;
+        key += request.withStats ? "|stats" : "";
+        key += request.withFacets ? "|facets" : "";
+        return key;
+    }
+
+    // Paging fields of a search or category request: "limit", "offset" and
+    // "cursor", the nextCursor of the previous page. A cursor only pages the
+    // request it came from, checked through fingerprint.
+    static PageRequest parsePageRequest(const json& request, uint32_t fingerprint) {
+        PageRequest page;
+        if (request.contains("limit")) {
+            page.limit = request["limit"].get<size_t>();
+            if (page.limit == 0 || page.limit > MAX_RESULT_LIMIT) {
+                throw invalid_argument("limit must be between 1 and " + to_string(MAX_RESULT_LIMIT));
+            }
+            page.requested = true;
+        }
+        if (request.contains("offset")) {
+            page.offset = request["offset"].get<size_t>();
+            if (page.offset > MAX_OFFSET) {
+                throw invalid_argument("offset must be at most " + to_string(MAX_OFFSET) + "; page further with cursor");
             }
-            node = node->children[c];
-            node->products.insert({-popularity, productId});
+            page.requested = true;
+        }
+        if (request.contains("cursor")) {
+            page.cursorToken = request["cursor"].get<string>();
+            page.after = decodeCursor(page.cursorToken, fingerprint);
+            page.requested = true;
         }
-        node->isEndOfWord = true;
+        return page;
     }
 
-    // Enhanced insert function that indexes multiple aspects of a product
-    void insertProduct(const Product& product) {
-        productMap[product.key] = product;
-        int popularity = static_cast<int>(product.rating * 100);
-        
-        // 1. Index full product name
-        insertTerm(product.name, popularity, product.key);
-        
-        // 2. Index individual words from product name
-        vector<string> nameWords = splitWords(product.name);
-        for (const string& word : nameWords) {
-            insertTerm(word, popularity, product.key);
+    // Cursor tokens are opaque to clients: 32 hex digits holding the last
+    // result's exact score bits, its product key and the fingerprint of the
+    // request that produced it
+    static string encodeCursor(const pair<double, int>& last, uint32_t fingerprint) {
+        uint64_t scoreBits;
+        memcpy(&scoreBits, &last.first, sizeof(scoreBits));
+        char token[33];
+        snprintf(token, sizeof(token), "%016llx%08x%08x", static_cast<unsigned long long>(scoreBits),
+                 static_cast<uint32_t>(last.second), fingerprint);
+        return token;
+    }
+
+    static ResultCursor decodeCursor(const string& token, uint32_t fingerprint) {
+        if (token.size() != 32 ||
+            !all_of(token.begin(), token.end(), [](unsigned char c) { return isxdigit(c); })) {
+            throw invalid_argument("Malformed cursor");
         }
-        
-        // 3. Index brand
-        if (!product.brand.empty()) {
-            insertTerm(product.brand, popularity, product.key);
+        if (static_cast<uint32_t>(stoul(token.substr(24, 8), nullptr, 16)) != fingerprint) {
+            throw invalid_argument("Cursor belongs to a different request");
         }
-        
-        // 4. Index category
-        if (!product.category.empty()) {
-            insertTerm(product.category, popularity, product.key);
+        uint64_t scoreBits = stoull(token.substr(0, 16), nullptr, 16);
+        ResultCursor cursor;
+        memcpy(&cursor.score, &scoreBits, sizeof(scoreBits));
+        cursor.productId = static_cast<int>(static_cast<uint32_t>(stoul(token.substr(16, 8), nullptr, 16)));
+        return cursor;
+    }
+
+    static uint32_t cursorFingerprint(const string& request) {
+        return static_cast<uint32_t>(EnhancedTrie::hashString(request));
+    }
+
+    // Ranking does not depend on the evaluation mode, so neither does this
+    static uint32_t searchFingerprint(const SearchRequest& search) {
+        return cursorFingerprint("search\x1f" + asciiLower(search.searchTerm) + '\x1f' + search.filtersKey);
+    }
+
+    // A search op's q, mode, filters, limit, offset, cursor, budgetMs, stats
+    // and facets
+    SearchRequest parseSearchRequest(const json& request) const {
+        SearchRequest search;
+        search.searchTerm = request.at("q").get<string>();
+        if (request.contains("mode")) {
+            search.options.mode = parseEvaluationMode(request["mode"].get<string>());
         }
-        
-        // 5. Index words from description (optional - might make search too broad)
-        vector<string> descWords = splitWords(product.description);
-        for (const string& word : descWords) {
-            if (word.length() > 3) {  // Only index longer words from description
-                insertTerm(word, popularity / 2, product.key);  // Lower priority for description matches
-            }
+        if (request.contains("filters")) {
+            search.options.filter = parseFacetFilter(request["filters"]);
+            search.filtersKey = request["filters"].dump();
         }
+        PageRequest page = parsePageRequest(request, searchFingerprint(search));
+        search.paged = page.requested;
+        search.options.limit = page.limit;
+        search.options.offset = page.offset;
+        search.options.after = page.after;
+        search.cursorToken = page.cursorToken;
+        search.withStats = request.value("stats", false);
+        search.withFacets = request.value("facets", false);
+        search.budget = request.contains("budgetMs")
+            ? Deadline::budgetFromMs(request["budgetMs"].get<double>())
+            : defaultBudget;
+        return search;
     }
 
-    // Search for products by prefix
-    vector<int> searchByPrefix(const string& prefix) const {
-        string lowerPrefix = toLowerCase(prefix);
-        TrieNode* node = root;
-        for (char c : lowerPrefix) {
-            if (!node->children[c]) return {};
-            node = node->children[c];
+    // One response per query, in order, each shaped like a search op's. All
+    // run against one catalog version; queries that normalize alike run
+    // once, and the distinct ones are spread over the query pool. A query
+    // that fails gets an error object in its place.
+    json runBatch(const json& queries) {
+        PinnedCatalog catalog = requireCatalog();
+        size_t count = queries.size();
+        vector<SearchRequest> searches(count);
+        vector<json> responses(count);
+        vector<size_t> runs;            // queries that run, first of their key
+        vector<size_t> sourceOf(count);  // query whose response each one shares
+        unordered_map<string, size_t> firstByKey;
+        for (size_t i = 0; i < count; i++) {
+            try {
+                searches[i] = parseSearchRequest(queries[i]);
+            } catch (const exception& e) {
+                responses[i] = serializeErrorToJson(e);
+                sourceOf[i] = i;
+                continue;
+            }
+            auto [first, added] = firstByKey.emplace(searchCacheKey(searches[i]), i);
+            sourceOf[i] = first->second;
+            if (added) runs.push_back(i);
         }
 
-        set<int> uniqueResults;  // Use set to avoid duplicates
-        for (const auto& product : node->products) {
-            uniqueResults.insert(product.second);
-            if (uniqueResults.size() >= 15) break;  // Get more results to filter later
+        queryPool.run(runs.size(), [&](size_t task) {
+            size_t i = runs[task];
+            try {
+                responses[i] = runSearch(*catalog.catalog, searches[i]);
+            } catch (const exception& e) {
+                responses[i] = serializeErrorToJson(e);
+            }
+        });
+
+        json results = json::array();
+        for (size_t i = 0; i < count; i++) {
+            json response = responses[sourceOf[i]];
+            if (sourceOf[i] != i && !response.contains("error")) {
+                response["searchTerm"] = searches[i].searchTerm;
+            }
+            results.push_back(move(response));
         }
-        
-        return vector<int>(uniqueResults.begin(), uniqueResults.end());
+        return results;
     }
 
-    // Advanced search that combines multiple strategies
-    vector<int> advancedSearch(const string& query) const {
-        vector<string> queryWords = splitWords(query);
-        map<int, double> productScores;  // product_id -> relevance score
-        
-        // Strategy 1: Direct prefix match on full query
-        vector<int> directResults = searchByPrefix(query);
-        for (int productId : directResults) {
-            productScores[productId] += 10.0;  // High score for direct matches
+    json runSearch(const SearchRequest& request) {
+        PinnedCatalog catalog = requireCatalog();
+        return runSearch(*catalog.catalog, request);
+    }
+
+    // Answer from the hot responses or the cache when they hold this
+    // generation's response, otherwise run the query. The caller keeps
+    // catalog pinned.
+    json runSearch(const CatalogIndex& catalog, const SearchRequest& request) {
+        if (!resultCache.enabled()) {
+            return computeSearch(catalog, request);
         }
-        
-        // Strategy 2: Search for each word in the query
-        for (const string& word : queryWords) {
-            vector<int> wordResults = searchByPrefix(word);
-            for (int productId : wordResults) {
-                productScores[productId] += 5.0;  // Medium score for word matches
-            }
+
+        string key = searchCacheKey(request);
+        {
+            unique_lock<mutex> lock(heavyHittersMutex, try_to_lock);
+            if (lock.owns_lock()) heavyHitters.offer(key, request);
         }
-        
-        // Strategy 3: Fuzzy matching (simple edit distance for short queries)
-        if (query.length() <= 8) {
-            for (const auto& [productId, product] : productMap) {
-                if (isApproximateMatch(query, product.name) ||
-                    isApproximateMatch(query, product.brand) ||
-                    isApproximateMatch(query, product.category)) {
-                    productScores[productId] += 2.0;  // Lower score for fuzzy matches
-                }
+
+        json result;
+        const HotResults* materialized = hot.load();  // kept alive by the catalog pin
+        if (materialized && materialized->generation == catalog.generation()) {
+            auto it = materialized->responses.find(key);
+            if (it != materialized->responses.end()) {
+                hotHits.fetch_add(1, memory_order_relaxed);
+                result = *it->second;
+                result["searchTerm"] = request.searchTerm;
+                return result;
             }
         }
-        
-        // Convert to sorted vector
-        vector<pair<double, int>> scoredResults;
-        for (const auto& [productId, score] : productScores) {
-            // Boost score based on product rating
-            double finalScore = score + (productMap.at(productId).rating * 0.5);
-            scoredResults.push_back({finalScore, productId});
+        if (resultCache.lookup(key, catalog.generation(), result)) {
+            result["searchTerm"] = request.searchTerm;
+            return result;
         }
-        
-        sort(scoredResults.rbegin(), scoredResults.rend());  // Sort by score descending
-        
+
+        result = computeSearch(catalog, request);
+        if (!result.contains("degraded")) {
+            resultCache.insert(key, catalog.generation(), result);
+        }
+        return result;
+    }
+
+    // Run the query within its budget; a response the deadline cut short
+    // holds the best results found in time and "degraded": true, but no
+    // nextCursor, since the next page of a partial ranking could skip results
+    json computeSearch(const CatalogIndex& catalog, const SearchRequest& request) const {
+        SearchOptions options = request.options;
+        options.deadline = Deadline::after(request.budget);
+        SearchStats stats;
+        FacetCounts facetCounts;
+        vector<pair<double, int>> ranked = catalog.rankedPage(request.searchTerm, options, &stats,
+                                                              request.withFacets ? &facetCounts : nullptr);
         vector<int> results;
-        int maxResults = 10;
-        
-        // If searching for a category, return more results
-        bool isCategorySearch = false;
-        for (const auto& [productId, product] : productMap) {
-            if (toLowerCase(product.category) == toLowerCase(query)) {
-                isCategorySearch = true;
-                maxResults = 50; // Return up to 50 products for category searches
-                break;
-            }
+        for (const auto& entry : ranked) results.push_back(entry.second);
+        json result = serializeResultsToJson(request.searchTerm, results,
+                                             catalog.suggestCorrections(request.searchTerm));
+        bool fullPage = ranked.size() == catalog.pageLimit(request.searchTerm, options);
+        if (request.paged && fullPage && !stats.degraded) {
+            result["nextCursor"] = encodeCursor(ranked.back(), searchFingerprint(request));
         }
-        
-        for (const auto& [score, productId] : scoredResults) {
-            results.push_back(productId);
-            if (results.size() >= maxResults) break;
+        if (stats.degraded) {
+            result["degraded"] = true;
         }
-        
-        return results;
+        if (request.withStats) {
+            result["stats"] = serializeStatsToJson(request.options, stats);
+        }
+        if (request.withFacets) {
+            result["facets"] = serializeFacetCountsToJson(facetCounts);
+        }
+        return result;
     }
 
-    // Dedicated method to get ALL products in a specific category
-    vector<int> searchByCategory(const string& category) const {
-        vector<pair<double, int>> categoryProducts;
-        string lowerCategory = toLowerCase(category);
-        
-        for (const auto& [productId, product] : productMap) {
-            if (toLowerCase(product.category) == lowerCategory) {
-                double score = product.rating * 10; // Score based on rating
-                categoryProducts.push_back({score, productId});
+    // Rebuild the hot responses after each publish, and periodically so
+    // queries that become frequent are picked up
+    void refreshLoop() {
+        unique_lock<mutex> lock(refreshMutex);
+        while (!stopping) {
+            refreshWake.wait_for(lock, HOT_REFRESH_INTERVAL, [this]() { return stopping || refreshRequested; });
+            if (stopping) break;
+            refreshRequested = false;
+            lock.unlock();
+            try {
+                refreshHotResults();
+            } catch (const exception& e) {
+                cerr << "Hot query refresh failed: " << e.what() << endl;
             }
+            lock.lock();
         }
-        
-        sort(categoryProducts.rbegin(), categoryProducts.rend()); // Sort by score descending
-        
-        vector<int> results;
-        for (const auto& [score, productId] : categoryProducts) {
-            results.push_back(productId);
+    }
+
+    // Materialize the heavy hitters for the published catalog, reusing
+    // responses already computed for it. A publish during the refresh
+    // leaves a snapshot for the old generation, which lookups ignore, and
+    // requests another refresh.
+    void refreshHotResults() {
+        PinnedCatalog catalog = pinCatalog();
+        if (!catalog.catalog) return;
+
+        vector<SpaceSaving<SearchRequest>::Counter> top;
+        {
+            lock_guard<mutex> lock(heavyHittersMutex);
+            top = heavyHitters.top(HOT_QUERIES);
         }
-        
-        return results;
+        const HotResults* previous = hot.load();
+        bool reuse = previous && previous->generation == catalog->generation();
+        auto fresh = make_unique<HotResults>();
+        fresh->generation = catalog->generation();
+        size_t computed = 0;
+        for (const auto& counter : top) {
+            if (counter.count - counter.error < HOT_MIN_COUNT) continue;
+            if (reuse) {
+                auto it = previous->responses.find(counter.key);
+                if (it != previous->responses.end()) {
+                    fresh->responses.emplace(counter.key, it->second);
+                    continue;
+                }
+            }
+            try {
+                SearchRequest unbounded = counter.item;  // off the request path, so no budget
+                unbounded.budget = chrono::microseconds{0};
+                auto response = make_shared<const json>(computeSearch(*catalog.catalog, unbounded));
+                fresh->responses.emplace(counter.key, move(response));
+                computed++;
+            } catch (const exception&) {
+                // A query that fails is answered (with its error) when asked
+            }
+        }
+        if (reuse && computed == 0 && fresh->responses.size() == previous->responses.size()) return;
+
+        const HotResults* replaced = hot.exchange(fresh.release());
+        if (replaced) reclaimer.retire([replaced]() { delete replaced; });
     }
+};
 
-private:
-    // Simple fuzzy matching for short strings
-    bool isApproximateMatch(const string& query, const string& target) const {
-        string lowerQuery = toLowerCase(query);
-        string lowerTarget = toLowerCase(target);
-        
-        // Check if query is a substring of target
-        if (lowerTarget.find(lowerQuery) != string::npos) {
+// Largest length-prefixed payload accepted; a whole-catalog reload is the
+// biggest request a client sends
+const size_t MAX_FRAME_BYTES = size_t{1} << 28;
+
+// Starts a length prefix line. A control byte, so no typed query is ever
+// mistaken for one
+const char FRAME_MARKER = '\x01';
+
+// Read one request frame. A line of FRAME_MARKER then N in digits is a length
+// prefix and the payload is the next N bytes; any other line, "#12" or "2024"
+// included, is a newline-delimited payload. A malformed or oversized prefix
+// sets error instead of a payload.
+bool readFrame(istream& in, string& payload, string& error) {
+    error.clear();
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+
+        if (line[0] == FRAME_MARKER) {
+            string digits = line.substr(1);
+            bool numeric = all_of(digits.begin(), digits.end(), [](unsigned char c) { return isdigit(c); });
+            if (digits.empty() || !numeric) {
+                error = "Malformed frame length";
+                return true;
+            }
+            size_t length = 0;
+            for (size_t i = 0; i < digits.size() && length <= MAX_FRAME_BYTES; i++) {
+                length = length * 10 + static_cast<size_t>(digits[i] - '0');
+            }
+            if (length > MAX_FRAME_BYTES) {
+                error = "Frame of " + digits + " bytes exceeds the " + to_string(MAX_FRAME_BYTES) + " byte limit";
+                return true;
+            }
+            payload.assign(length, '\0');
+            in.read(&payload[0], length);
+            if (static_cast<size_t>(in.gcount()) != length) return false;
+            if (in.peek() == '\n') in.get();
             return true;
         }
-        
-        // Simple edit distance check (only for short queries)
-        if (lowerQuery.length() <= 4) {
-            return editDistance(lowerQuery, lowerTarget) <= 1;
+
+        payload = line;
+        return true;
+    }
+    return false;
+}
+
+// Answer frames until the stream closes; every response is one line of JSON
+void serveStream(SearchEngine& engine, istream& in, ostream& out) {
+    string payload, error;
+    while (readFrame(in, payload, error)) {
+        json response = error.empty() ? engine.handleRequest(payload) : serializeErrorToJson(error, true);
+        out << response.dump() << '\n';
+        out.flush();
+    }
+}
+
+// Minimal streambuf over a socket descriptor so connections reuse serveStream
+class FdStreamBuf : public streambuf {
+public:
+    explicit FdStreamBuf(int fd) : fd(fd) {
+        setg(inBuffer, inBuffer, inBuffer);
+        setp(outBuffer, outBuffer + sizeof(outBuffer));
+    }
+
+    ~FdStreamBuf() override { sync(); }
+
+protected:
+    int_type underflow() override {
+        ssize_t n = ::read(fd, inBuffer, sizeof(inBuffer));
+        if (n <= 0) return traits_type::eof();
+        setg(inBuffer, inBuffer, inBuffer + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type ch) override {
+        if (sync() != 0) return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
         }
-        
-        return false;
+        return traits_type::not_eof(ch);
     }
-    
-    // Simple edit distance calculation
-    int editDistance(const string& s1, const string& s2) const {
-        if (s1.length() > s2.length()) return editDistance(s2, s1);
-        
-        vector<int> prev(s1.length() + 1);
-        vector<int> curr(s1.length() + 1);
-        
-        for (int i = 0; i <= s1.length(); i++) prev[i] = i;
-        
-        for (int i = 1; i <= s2.length(); i++) {
-            curr[0] = i;
-            for (int j = 1; j <= s1.length(); j++) {
-                if (s1[j-1] == s2[i-1]) {
-                    curr[j] = prev[j-1];
-                } else {
-                    curr[j] = 1 + min({prev[j], curr[j-1], prev[j-1]});
-                }
-            }
-            prev = curr;
+
+    int sync() override {
+        char* data = pbase();
+        while (data < pptr()) {
+            ssize_t n = ::write(fd, data, pptr() - data);
+            if (n <= 0) return -1;
+            data += n;
         }
-        
-        return prev[s1.length()];
+        setp(outBuffer, outBuffer + sizeof(outBuffer));
+        return 0;
     }
+
+private:
+    int fd;
+    char inBuffer[65536];
+    char outBuffer[65536];
 };
 
-// Function to read products from stdin
-vector<Product> readProductsFromStdin() {
-    vector<Product> products;
-    string input;
-    getline(cin, input);
-    
-    cerr << "Received input length: " << input.length() << endl;
-    
+// Listen on a Unix domain socket, one thread per connection
+int serveUnixSocket(SearchEngine& engine, const string& socketPath) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        cerr << "Failed to create socket: " << strerror(errno) << endl;
+        return 1;
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path too long: " << socketPath << endl;
+        return 1;
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    unlink(socketPath.c_str());
+
+    if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(listener, 64) < 0) {
+        cerr << "Failed to listen on " << socketPath << ": " << strerror(errno) << endl;
+        close(listener);
+        return 1;
+    }
+    cerr << "Search daemon listening on " << socketPath << endl;
+
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Accept failed: " << strerror(errno) << endl;
+            break;
+        }
+        thread([&engine, connection]() {
+            {
+                FdStreamBuf buffer(connection);
+                istream in(&buffer);
+                ostream out(&buffer);
+                serveStream(engine, in, out);
+            }
+            close(connection);
+        }).detach();
+    }
+
+    close(listener);
+    return 1;
+}
+
+// search --serve [--catalog <file> | --index <file>] [--socket <path>] [--threads <n>] [--cache <entries>]
+//               [--budget-ms <ms>] [--stop-words <file>]
+int runDaemon(int argc, char* argv[]) {
+    string catalogPath;
+    string indexPath;
+    string socketPath;
+    size_t threads = 0;
+    size_t cacheEntries = ResultCache::DEFAULT_CAPACITY;
+    chrono::microseconds budget{0};
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheEntries = stoul(argv[++i]);
+        } else if (arg == "--budget-ms" && i + 1 < argc) {
+            budget = Deadline::budgetFromMs(stod(argv[++i]));
+        } else if (arg == "--catalog" && i + 1 < argc) {
+            catalogPath = argv[++i];
+        } else if (arg == "--index" && i + 1 < argc) {
+            indexPath = argv[++i];
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--stop-words" && i + 1 < argc) {
+            if (!StopWords::load(argv[++i])) return 1;
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+
+    SearchEngine engine(WorkerPool::threadsFor(threads), cacheEntries);
+    engine.setSearchBudget(budget);
+    if (!indexPath.empty()) {
+        try {
+            size_t count = engine.loadIndex(indexPath);
+            cerr << "Mapped " << count << " products from " << indexPath << endl;
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+    } else if (!catalogPath.empty()) {
+        size_t count = engine.reload(readProductsFromFile(catalogPath));
+        cerr << "Loaded " << count << " products from " << catalogPath << endl;
+    }
+
+    if (!socketPath.empty()) {
+        return serveUnixSocket(engine, socketPath);
+    }
+
+    serveStream(engine, cin, cout);
+    return 0;
+}
+
+// search --batch <queries> [--index <file>] [--threads <n>] [--stop-words <file>]:
+// run a JSON array of search requests, e.g. [{"q": "phone", "limit": 5},
+// {"q": "watch", "filters": {"brand": "casio"}}], against one build of the
+// catalog on stdin
+int runBatchSearch(int argc, char* argv[]) {
+    json queries;
     try {
-        json data = json::parse(input);
-        cerr << "Successfully parsed JSON" << endl;
-        
-        if (data.is_array()) {
-            cerr << "Input is an array with " << data.size() << " elements" << endl;
-            
-            for (const auto& entry : data) {
-                try {
-                    Product product(
-                        entry["id"].get<int>(),
-                        entry["title"].get<string>(),
-                        entry["category"].get<string>(),
-                        entry["rating"].get<double>(),
-                        entry["stock"].get<int>(),
-                        entry["price"].get<double>(),
-                        entry["thumbnail"].get<string>(),
-                        entry["description"].get<string>(),
-                        entry["brand"].get<string>(),
-                        entry["discountPercentage"].get<double>()
-                    );
-                    products.push_back(product);
-                } catch (const exception& e) {
-                    cerr << "Error parsing product: " << e.what() << endl;
-                }
+        queries = json::parse(argv[2]);
+    } catch (const exception& e) {
+        cerr << "Invalid batch: " << e.what() << endl;
+        return 1;
+    }
+    string indexPath;
+    size_t threads = 0;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--index" && i + 1 < argc) {
+            indexPath = argv[++i];
+        } else if (arg == "--stop-words" && i + 1 < argc) {
+            if (!StopWords::load(argv[++i])) return 1;
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+
+    // No result cache: duplicate queries in the batch already share a run
+    SearchEngine engine(WorkerPool::threadsFor(threads), 0);
+    json results;
+    try {
+        if (!indexPath.empty()) {
+            engine.loadIndex(indexPath);
+        } else {
+            vector<Product> products = readProductsFromStdin();
+            if (products.empty()) {
+                cerr << "No products read from input" << endl;
+                return 1;
             }
+            engine.reload(products);
         }
+        results = engine.batch(queries);
     } catch (const exception& e) {
-        cerr << "Error parsing input: " << e.what() << endl;
+        cerr << e.what() << endl;
+        return 1;
     }
-    
-    cerr << "Total products parsed: " << products.size() << endl;
-    return products;
+    cout << json{{"results", results}}.dump(4) << endl;
+    return 0;
 }
 
-// Function to serialize product IDs to JSON format
-json serializeResultsToJson(const string& searchTerm, const vector<int>& productIds) {
-    return json{{"searchTerm", searchTerm}, {"recommendations", productIds}};
+// Build a trie from the catalog JSON on stdin with threads workers
+bool buildFromStdin(EnhancedTrie& trie, size_t threads) {
+    vector<Product> products = readProductsFromStdin();
+
+    if (products.empty()) {
+        cerr << "No products read from input" << endl;
+        return false;
+    }
+
+    // Create Enhanced Trie and insert products
+    WorkerPool pool(threads);
+    trie.insertProducts(products, pool);
+    trie.freeze(pool);
+    return true;
+}
+
+// search --build-index <file> [--threads <n>] [--stop-words <file>]: index
+// the catalog on stdin and save it for --index, reporting the index's size
+int buildIndexFile(int argc, char* argv[]) {
+    size_t threads = 0;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--stop-words" && i + 1 < argc) {
+            if (!StopWords::load(argv[++i])) return 1;
+        } else {
+            cerr << "Usage: " << argv[0] << " --build-index <file> [--threads <n>] [--stop-words <file>]" << endl;
+            return 1;
+        }
+    }
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " --build-index <file> [--threads <n>] [--stop-words <file>]" << endl;
+        return 1;
+    }
+    EnhancedTrie trie;
+    if (!buildFromStdin(trie, WorkerPool::threadsFor(threads)) || !trie.saveIndex(argv[2])) return 1;
+    struct stat file;
+    size_t fileBytes = stat(argv[2], &file) == 0 ? static_cast<size_t>(file.st_size) : 0;
+    json sizes = serializeIndexSizesToJson(trie.indexSizes());
+    sizes["fileBytes"] = fileBytes;
+    cout << json{{"ok", true}, {"products", trie.productCount()}, {"path", argv[2]}, {"index", sizes}}.dump() << endl;
+    return 0;
+}
+
+// search --bench-build [maxThreads] < catalog.json: build the catalog on 1,
+// 2, 4, ... maxThreads threads (default: every hardware thread) and report
+// each build's time. Equal checksums show every build made the same index.
+int benchBuild(int argc, char* argv[]) {
+    size_t maxThreads = WorkerPool::threadsFor(argc > 2 ? stoul(argv[2]) : 0);
+    vector<Product> products = readProductsFromStdin();
+    if (products.empty()) {
+        cerr << "No products read from input" << endl;
+        return 1;
+    }
+
+    vector<size_t> threadCounts;
+    for (size_t threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    auto elapsedMs = [](chrono::steady_clock::time_point from, chrono::steady_clock::time_point to) {
+        return chrono::duration<double, milli>(to - from).count();
+    };
+    double serialMs = 0;
+    for (size_t threads : threadCounts) {
+        WorkerPool pool(threads);
+        auto trie = make_unique<EnhancedTrie>();
+        auto start = chrono::steady_clock::now();
+        trie->insertProducts(products, pool);
+        auto inserted = chrono::steady_clock::now();
+        trie->freeze(pool);
+        auto frozen = chrono::steady_clock::now();
+
+        double totalMs = elapsedMs(start, frozen);
+        if (threads == 1) serialMs = totalMs;
+        cout << json{{"threads", threads},
+                     {"products", trie->productCount()},
+                     {"insertMs", elapsedMs(start, inserted)},
+                     {"freezeMs", elapsedMs(inserted, frozen)},
+                     {"totalMs", totalMs},
+                     {"speedup", serialMs / totalMs},
+                     {"checksum", trie->indexChecksum()}}.dump() << endl;
+    }
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " <searchTerm>" << endl;
+        cerr << "Usage: " << argv[0] << " <searchTerm> [--mode exhaustive|wand|bmw] [--stats]"
+             << " [--filters <json>] [--facets] [--explain]" << endl;
+        cerr << "       " << argv[0] << " <prefix> --typeahead" << endl;
+        cerr << "       " << argv[0] << " <searchTerm|prefix> ... --index <file> [--verify-index]" << endl;
+        cerr << "       " << argv[0] << " <searchTerm|prefix> ... --threads <n>" << endl;
+        cerr << "       " << argv[0] << " <searchTerm> ... --budget-ms <ms>" << endl;
+        cerr << "       " << argv[0] << " <searchTerm|prefix> ... --stop-words <file>" << endl;
+        cerr << "       " << argv[0] << " --batch <queries> [--index <file>] [--threads <n>] [--stop-words <file>]"
+             << endl;
+        cerr << "       " << argv[0] << " --build-index <file> [--threads <n>] [--stop-words <file>]" << endl;
+        cerr << "       " << argv[0] << " --bench-build [maxThreads]" << endl;
+        cerr << "       " << argv[0] << " --serve [--catalog <file> | --index <file>] [--socket <path>]"
+             << " [--threads <n>] [--cache <entries>] [--budget-ms <ms>] [--stop-words <file>]" << endl;
         return 1;
     }
+
+    if (string(argv[1]) == "--serve") {
+        return runDaemon(argc, argv);
+    }
+    if (string(argv[1]) == "--build-index") {
+        return buildIndexFile(argc, argv);
+    }
+    if (string(argv[1]) == "--bench-build") {
+        return benchBuild(argc, argv);
+    }
+    if (string(argv[1]) == "--batch" && argc >= 3) {
+        return runBatchSearch(argc, argv);
+    }
     
     string searchTerm = argv[1];
-    vector<Product> products = readProductsFromStdin();
+    SearchOptions options;
+    bool withStats = false;
+    bool withFacets = false;
+    bool withPlan = false;
+    bool typeahead = false;
+    string indexPath;
+    bool verifyIndex = false;
+    size_t threads = 0;
+    chrono::microseconds budget{0};
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--budget-ms" && i + 1 < argc) {
+            budget = Deadline::budgetFromMs(stod(argv[++i]));
+        } else if (arg == "--index" && i + 1 < argc) {
+            indexPath = argv[++i];
+        } else if (arg == "--verify-index") {
+            verifyIndex = true;
+        } else if (arg == "--stop-words" && i + 1 < argc) {
+            if (!StopWords::load(argv[++i])) return 1;
+        } else if (arg == "--stats") {
+            withStats = true;
+        } else if (arg == "--typeahead") {
+            typeahead = true;
+        } else if (arg == "--explain") {
+            withPlan = true;
+        } else if (arg == "--facets") {
+            withFacets = true;
+        } else if ((arg == "--mode" || arg == "--filters") && i + 1 < argc) {
+            try {
+                if (arg == "--mode") {
+                    options.mode = parseEvaluationMode(argv[++i]);
+                } else {
+                    options.filter = parseFacetFilter(json::parse(argv[++i]));
+                }
+            } catch (const exception& e) {
+                cerr << e.what() << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Unknown argument: " << arg << endl;
+            return 1;
+        }
+    }
 
-    if (products.empty()) {
-        cerr << "No products read from input" << endl;
+    // Map a prebuilt index when given one; otherwise build from the catalog on stdin
+    EnhancedTrie trie;
+    if (!indexPath.empty()) {
+        if (!trie.loadIndex(indexPath, verifyIndex)) return 1;
+    } else if (!buildFromStdin(trie, WorkerPool::threadsFor(threads))) {
         return 1;
     }
 
-    // Create Enhanced Trie and insert products
-    EnhancedTrie trie;
-    for (const auto& product : products) {
-        trie.insertProduct(product);
+    if (typeahead) {
+        cout << json{{"searchTerm", searchTerm}, {"completions", trie.completions(searchTerm)}}.dump(4) << endl;
+        return 0;
     }
 
     // Perform advanced search
-    vector<int> results = trie.advancedSearch(searchTerm);
+    SearchStats stats;
+    FacetCounts facetCounts;
+    options.deadline = Deadline::after(budget);
+    vector<int> results = trie.advancedSearch(searchTerm, options, &stats, withFacets ? &facetCounts : nullptr);
     
     // Convert the results to JSON format and output
-    json result = serializeResultsToJson(searchTerm, results);
+    json result = serializeResultsToJson(searchTerm, results, trie.suggestCorrections(searchTerm));
+    if (stats.degraded) {
+        result["degraded"] = true;
+    }
+    if (withStats) {
+        result["stats"] = serializeStatsToJson(options, stats);
+    }
+    if (withFacets) {
+        result["facets"] = serializeFacetCountsToJson(facetCounts);
+    }
+    if (withPlan) {
+        result["plan"] = explainQuery(trie, searchTerm, options.filter);
+    }
     cout << result.dump(4) << endl;
 
     return 0;
-}
\ No newline at end of file
+}
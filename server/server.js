@@ -4,6 +4,7 @@ const { spawn } = require("child_process");
 const path = require('path');
 const fs = require("fs");
 const os = require("os");
+const readline = require('readline');
 const axios = require('axios');
 const { MongoClient } = require('mongodb');
 const bcrypt = require('bcryptjs');
@@ -20,8 +21,17 @@ class EcommerceServer {
         this.productsCache = null;
         this.lastFetchTime = 0;
         this.CACHE_DURATION = 3600000; // 1 hour
+        this.SEARCH_UPDATE_RATIO = 4; // refreshes changing over 1 in 4 products rebuild the search index
+        this.SEARCH_BUDGET_MS = Number(process.env.SEARCH_BUDGET_MS) || 50; // past this a search returns what it has, flagged degraded
+        this.SEARCH_STOP_WORDS = process.env.SEARCH_STOP_WORDS; // one word per line; unset keeps the built-in English list
         this.client = new MongoClient(process.env.MONGODB_URI);
         this.db = null;
+        this.searchDaemon = null;
+        this.searchDaemonCatalogTime = 0;
+        this.searchDaemonProducts = null; // id -> JSON of each product the daemon indexed
+        this.searchDaemonRequestId = 0;
+        this.searchIndexPath = path.join(os.tmpdir(), 'ecommerce-search.idx');
+        this.searchIndexCatalogTime = null;
         
         this.initializeMiddleware();
         this.initializeDatabase();
@@ -29,7 +39,7 @@ class EcommerceServer {
     }
 
     initializeMiddleware() {
-        this.app.use(cors());
+        this.app.use(cors({ exposedHeaders: ['X-Next-Cursor'] }));
         this.app.use(express.json());
     }
 
@@ -185,6 +195,213 @@ class EcommerceServer {
         });
     }
 
+    // Persistent search daemon (cpp_algorithms/search --serve)
+    startSearchDaemon() {
+        const executablePath = path.join(__dirname, 'cpp_algorithms', this.getExecutableFile('search'));
+        if (!fs.existsSync(executablePath)) {
+            throw new Error(`Executable not found: ${executablePath}`);
+        }
+
+        const child = spawn(executablePath, ['--serve', ...this.searchAnalyzerArgs()],
+            { cwd: path.dirname(executablePath) });
+        const daemon = { process: child, pending: new Map() };
+
+        readline.createInterface({ input: child.stdout }).on('line', (line) => {
+            let response;
+            try {
+                response = JSON.parse(line);
+            } catch (e) {
+                console.error('Failed to parse search daemon output:', line);
+                return;
+            }
+            const request = daemon.pending.get(response.id);
+            if (!request) return;
+            daemon.pending.delete(response.id);
+            if (response.error) {
+                request.reject(this.searchResponseError(response));
+            } else {
+                request.resolve(response);
+            }
+        });
+
+        child.stderr.on('data', (data) => console.error('Search daemon stderr:', data.toString()));
+
+        const shutdown = (reason) => {
+            if (this.searchDaemon === daemon) {
+                this.searchDaemon = null;
+                this.searchDaemonCatalogTime = 0;
+                this.searchDaemonProducts = null;
+            }
+            for (const request of daemon.pending.values()) {
+                request.reject(new Error(reason));
+            }
+            daemon.pending.clear();
+        };
+        child.on('exit', (code) => shutdown(`Search daemon exited with code ${code}`));
+        child.on('error', (err) => shutdown(`Search daemon failed: ${err.message}`));
+
+        this.searchDaemon = daemon;
+        console.log('Started search daemon:', executablePath);
+        return daemon;
+    }
+
+    // An error the search binary answered with. It reached the search, so
+    // running the request elsewhere would fail the same way; invalidRequest
+    // marks the caller's fault (a bad limit, offset or cursor)
+    searchResponseError(response) {
+        const error = new Error(response.error);
+        error.searchAnswered = true;
+        error.invalidRequest = Boolean(response.invalidRequest);
+        return error;
+    }
+
+    searchDaemonRequest(request) {
+        const daemon = this.searchDaemon || this.startSearchDaemon();
+        const id = ++this.searchDaemonRequestId;
+        return new Promise((resolve, reject) => {
+            daemon.pending.set(id, { resolve, reject });
+            daemon.process.stdin.write(JSON.stringify({ ...request, id }) + '\n');
+        });
+    }
+
+    // Products the daemon has indexed, by id, to diff later refreshes against
+    searchCatalogSnapshot(products) {
+        return new Map(products.map(product => [product.id, JSON.stringify(product)]));
+    }
+
+    // Upserts and removals that turn the daemon's catalog into products
+    searchCatalogChanges(snapshot) {
+        const upsert = [];
+        for (const [id, product] of snapshot) {
+            if (this.searchDaemonProducts.get(id) !== product) upsert.push(JSON.parse(product));
+        }
+        const remove = [...this.searchDaemonProducts.keys()].filter(id => !snapshot.has(id));
+        return { upsert, remove };
+    }
+
+    // Send the catalog to the daemon whenever the product cache has been refreshed.
+    // A refresh that changed few products is sent as an incremental update;
+    // otherwise the daemon rebuilds. The built index is saved to disk, so a
+    // restarted daemon or a one-shot search maps it instead of rebuilding from JSON.
+    async ensureSearchCatalog(products) {
+        if (this.searchDaemon && this.searchDaemonCatalogTime === this.lastFetchTime) return;
+        const snapshot = this.searchCatalogSnapshot(products);
+        if (this.searchDaemon && this.searchDaemonProducts) {
+            const { upsert, remove } = this.searchCatalogChanges(snapshot);
+            if ((upsert.length + remove.length) * this.SEARCH_UPDATE_RATIO <= snapshot.size) {
+                try {
+                    if (upsert.length || remove.length) {
+                        await this.searchDaemonRequest({ op: 'update', upsert, remove });
+                    }
+                    this.searchDaemonCatalogTime = this.lastFetchTime;
+                    this.searchDaemonProducts = snapshot;
+                    return;
+                } catch (e) {
+                    console.error('Incremental search update failed, reloading:', e);
+                }
+            }
+        }
+        if (this.searchIndexCatalogTime === this.lastFetchTime) {
+            try {
+                await this.searchDaemonRequest({ op: 'reload', index: this.searchIndexPath });
+                this.searchDaemonCatalogTime = this.lastFetchTime;
+                this.searchDaemonProducts = snapshot;
+                return;
+            } catch (e) {
+                console.error('Saved search index unusable, rebuilding:', e);
+                this.searchIndexCatalogTime = null;
+            }
+        }
+        await this.searchDaemonRequest({ op: 'reload', products });
+        this.searchDaemonCatalogTime = this.lastFetchTime;
+        this.searchDaemonProducts = snapshot;
+        try {
+            await this.searchDaemonRequest({ op: 'save', path: this.searchIndexPath });
+            this.searchIndexCatalogTime = this.lastFetchTime;
+        } catch (e) {
+            console.error('Could not save search index:', e);
+        }
+    }
+
+    // Every search process must analyze text the same way, or a saved index
+    // built by one is rejected by the next
+    searchAnalyzerArgs() {
+        return this.SEARCH_STOP_WORDS ? ['--stop-words', this.SEARCH_STOP_WORDS] : [];
+    }
+
+    // Arguments and stdin for a one-shot search: the saved index while it
+    // matches the product cache, otherwise the catalog to build from
+    oneShotSearchInput(args, products) {
+        args = [...args, ...this.searchAnalyzerArgs()];
+        if (this.searchIndexCatalogTime === this.lastFetchTime && fs.existsSync(this.searchIndexPath)) {
+            return { args: [...args, '--index', this.searchIndexPath], input: null };
+        }
+        return { args, input: JSON.stringify(products) };
+    }
+
+    async runDaemonSearch(searchTerm, products, filters, page) {
+        await this.ensureSearchCatalog(products);
+        const request = { op: 'search', q: searchTerm, budgetMs: this.SEARCH_BUDGET_MS, ...page };
+        if (filters) request.filters = filters;
+        return this.searchDaemonRequest(request);
+    }
+
+    // limit, offset and cursor from a request's query params or POST body;
+    // a page's cursor comes back in the X-Next-Cursor header. Throws an
+    // invalidRequest error for a limit or offset that is not a whole number.
+    searchPageFromRequest(req) {
+        const source = { ...req.body, ...req.query };
+        const page = {};
+        for (const name of ['limit', 'offset']) {
+            if (source[name] === undefined || source[name] === '') continue;
+            const value = Number(source[name]);
+            if (!Number.isInteger(value) || value < 0) {
+                const error = new Error(`${name} must be a non-negative integer`);
+                error.invalidRequest = true;
+                throw error;
+            }
+            page[name] = value;
+        }
+        if (source.cursor) page.cursor = String(source.cursor);
+        return page;
+    }
+
+    // One result object per request, from the daemon's batch op or else a
+    // single one-shot --batch spawn; duplicate queries share one run. Only a
+    // daemon that could not be reached falls back: an error it answered with
+    // is thrown.
+    async runSearchBatch(requests, products) {
+        try {
+            await this.ensureSearchCatalog(products);
+            const queries = requests.map(request => ({ ...request, budgetMs: this.SEARCH_BUDGET_MS }));
+            return (await this.searchDaemonRequest({ op: 'batch', queries })).results;
+        } catch (daemonError) {
+            if (daemonError.searchAnswered) throw daemonError;
+            console.error('Search daemon failed, spawning one-shot batch:', daemonError);
+            const { args, input } = this.oneShotSearchInput(['--batch', JSON.stringify(requests)], products);
+            return (await this.runCppExecutable('./cpp_algorithms/search', args, input)).results;
+        }
+    }
+
+    // Sidebar filters from a POST body's "filters" object, or from the
+    // brand, category, minPrice, maxPrice, minRating and inStock query params
+    searchFiltersFromRequest(req) {
+        if (req.body && req.body.filters) return req.body.filters;
+
+        const { brand, category, minPrice, maxPrice, minRating, inStock } = req.query;
+        const filters = {};
+        if (brand) filters.brand = [].concat(brand);
+        if (category) filters.category = [].concat(category);
+        if (minPrice || maxPrice) {
+            filters.price = {};
+            if (minPrice) filters.price.min = Number(minPrice);
+            if (maxPrice) filters.price.max = Number(maxPrice);
+        }
+        if (minRating) filters.rating = { min: Number(minRating) };
+        if (inStock === 'true') filters.inStock = true;
+        return Object.keys(filters).length ? filters : null;
+    }
+
     // Route Handlers
     async handleProductIds(req, res) {
         try {
@@ -312,26 +529,45 @@ class EcommerceServer {
             }
 
             console.log('Searching for:', searchTerm);
+            const filters = this.searchFiltersFromRequest(req);
+            let page;
+            try {
+                page = this.searchPageFromRequest(req);
+            } catch (pageError) {
+                return res.status(400).json({ error: pageError.message });
+            }
 
             try {
                 // Get products first
                 const products = await this.getProducts();
                 console.log('Got', products.length, 'products');
 
-                // Convert products to JSON string for C++ input
-                const productsJson = JSON.stringify(products);
-                
-                // Use C++ search algorithm
-                const executablePath = path.join(__dirname, 'cpp_algorithms', 'search');
-                console.log('Looking for C++ executable at:', executablePath);
-                
-                if (!fs.existsSync(executablePath)) {
-                    console.error('C++ search executable not found at:', executablePath);
-                    throw new Error('Search executable not found');
-                }
+                let result;
+                try {
+                    // Prefer the resident search daemon; the index stays built between queries
+                    result = await this.runDaemonSearch(searchTerm, products, filters, page);
+                } catch (daemonError) {
+                    if (daemonError.searchAnswered) throw daemonError;
+                    console.error('Search daemon failed, spawning one-shot search:', daemonError);
+
+                    // Use C++ search algorithm
+                    const executablePath = path.join(__dirname, 'cpp_algorithms', 'search');
+                    console.log('Looking for C++ executable at:', executablePath);
+
+                    if (!fs.existsSync(executablePath)) {
+                        console.error('C++ search executable not found at:', executablePath);
+                        throw new Error('Search executable not found');
+                    }
 
-                const result = await this.runCppExecutable('./cpp_algorithms/search', [searchTerm], productsJson);
+                    // A one-query batch, so the page and its cursor carry over
+                    const request = { q: searchTerm, ...page };
+                    if (filters) request.filters = filters;
+                    const { args, input } = this.oneShotSearchInput(['--batch', JSON.stringify([request])], products);
+                    result = (await this.runCppExecutable('./cpp_algorithms/search', args, input)).results[0];
+                    if (result.error) throw this.searchResponseError(result);
+                }
                 console.log('C++ search result:', result);
+                if (result.nextCursor) res.set('X-Next-Cursor', result.nextCursor);
                 
                 if (!result.recommendations || result.recommendations.length === 0) {
                     console.log('No recommendations found from C++ search');
@@ -353,12 +589,21 @@ class EcommerceServer {
                 console.log('Found', searchResults.length, 'products');
                 res.json(searchResults);
             } catch (cppError) {
+                if (cppError.invalidRequest) {
+                    return res.status(400).json({ error: cppError.message });
+                }
                 console.error('C++ search failed:', cppError);
+                if (page.cursor) {
+                    // Simple search cannot resume a cursor; page 1 would pass for the next page
+                    return res.status(503).json({ error: 'Search is unavailable' });
+                }
                 // Fallback to simple search
                 console.log('Falling back to simple search');
                 const products = await this.getProducts();
+                const offset = page.offset || 0;
                 const searchResults = products
                     .filter(product => this.productMatchesQuery(product, searchTerm))
+                    .slice(offset, page.limit ? offset + page.limit : undefined)
                     .map(product => this.formatProductForFrontend(product))
                     .filter(Boolean); // Remove any null results
                 console.log('Found', searchResults.length, 'products using simple search');
@@ -370,6 +615,69 @@ class EcommerceServer {
         }
     }
 
+    // Many searches per page render (category landing pages, related
+    // searches): POST { queries: [{ q, filters, limit }, ...] } returns one
+    // product list per query, in order
+    async handleSearchBatch(req, res) {
+        const queries = req.body && req.body.queries;
+        if (!Array.isArray(queries) || queries.length === 0) {
+            return res.status(400).json({ error: 'No queries provided' });
+        }
+
+        try {
+            const products = await this.getProducts();
+            const productsById = new Map(products.map(product => [product.id, product]));
+            const requests = queries.map(({ q, filters, limit }) => {
+                const request = { q: String(q || '') };
+                if (filters) request.filters = filters;
+                if (limit !== undefined) request.limit = Number(limit);
+                return request;
+            });
+            if (requests.some(request => request.limit !== undefined && !Number.isInteger(request.limit))) {
+                return res.status(400).json({ error: 'limit must be an integer' });
+            }
+
+            const results = await this.runSearchBatch(requests, products);
+            const invalid = results.findIndex(result => result.invalidRequest);
+            if (invalid >= 0) {
+                return res.status(400).json({ error: results[invalid].error, query: invalid });
+            }
+            res.json(results.map(result => (result.recommendations || [])
+                .map(productId => productsById.get(productId))
+                .filter(Boolean)
+                .map(product => this.formatProductForFrontend(product))));
+        } catch (error) {
+            if (error.invalidRequest) {
+                return res.status(400).json({ error: error.message });
+            }
+            console.error('Batch search error:', error);
+            res.status(500).json({ error: 'Failed to search products' });
+        }
+    }
+
+    // Keystroke completions: one daemon round trip, no scoring pass
+    async handleTypeahead(req, res) {
+        try {
+            const prefix = req.query.q || '';
+            const limit = Number(req.query.limit) || 10;
+            const products = await this.getProducts();
+
+            let result;
+            try {
+                await this.ensureSearchCatalog(products);
+                result = await this.searchDaemonRequest({ op: 'typeahead', q: prefix, limit });
+            } catch (daemonError) {
+                console.error('Search daemon failed, spawning one-shot typeahead:', daemonError);
+                const { args, input } = this.oneShotSearchInput([prefix, '--typeahead'], products);
+                result = await this.runCppExecutable('./cpp_algorithms/search', args, input);
+            }
+            res.json((result.completions || []).slice(0, limit));
+        } catch (error) {
+            console.error('Typeahead error:', error);
+            res.status(500).json({ error: 'Failed to fetch completions' });
+        }
+    }
+
     productMatchesQuery(product, query) {
         const searchTerm = query.toLowerCase();
         return [
@@ -518,7 +826,9 @@ class EcommerceServer {
         this.app.get('/api/product-ids', this.handleProductIds.bind(this));
         this.app.get('/api/products', this.handleProducts.bind(this));
         this.app.get('/search', this.handleSearch.bind(this));
+        this.app.get('/search/typeahead', this.handleTypeahead.bind(this));
         this.app.post('/search', this.handleSearch.bind(this));
+        this.app.post('/search/batch', this.handleSearchBatch.bind(this));
         
         // Algorithm routes
         this.app.get('/api/trending/:tag?', this.handleTrending.bind(this));